@@ -0,0 +1,395 @@
+// Checks that the specialized backends minitouch picks for a device write
+// exactly the same events as the original emitters, which checked the
+// capabilities at runtime, for every combination of capabilities on both
+// Type A and Type B devices. Build and run it with `make test`.
+//
+// minitouch is included whole, so that its static functions can be used.
+
+#define main minitouch_main
+#include "../minitouch/minitouch.c"
+#undef main
+
+#define TEST_CONTACTS 10
+#define TEST_STEPS 5000
+
+// The emitters as they were before they were specialized, when they still
+// checked the device's capabilities as they went. Any change to what the
+// emitters write has to be made here too, so that it's a deliberate one.
+static int reference_type_a_commit(internal_state_t* state)
+{
+  int contact;
+  int found_any = 0;
+
+  for (contact = next_live_contact(state, 0); contact >= 0;
+      contact = next_live_contact(state, contact + 1))
+  {
+    switch (state->contacts[contact].enabled)
+    {
+      case 1: // WENT_DOWN
+        found_any = 1;
+
+        state->active_contacts += 1;
+
+        if (state->has_tracking_id)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+
+        // Send BTN_TOUCH on first contact only.
+        if (state->active_contacts == 1 && state->has_key_btn_touch)
+          WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 1);
+
+        if (state->has_touch_major)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+
+        if (state->has_width_major)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+
+        if (state->has_pressure)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, state->contacts[contact].pressure);
+
+        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, state->contacts[contact].x);
+        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, state->contacts[contact].y);
+
+        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+
+        set_contact_enabled(state, contact, 2);
+        break;
+      case 2: // MOVED
+        found_any = 1;
+
+        if (state->has_tracking_id)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+
+        if (state->has_touch_major)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+
+        if (state->has_width_major)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+
+        if (state->has_pressure)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, state->contacts[contact].pressure);
+
+        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, state->contacts[contact].x);
+        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, state->contacts[contact].y);
+
+        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+        break;
+      case 3: // WENT_UP
+        found_any = 1;
+
+        state->active_contacts -= 1;
+
+        if (state->has_tracking_id)
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+
+        // Send BTN_TOUCH only when no contacts remain.
+        if (state->active_contacts == 0 && state->has_key_btn_touch)
+          WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 0);
+
+        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+
+        set_contact_enabled(state, contact, 0);
+        break;
+    }
+  }
+
+  if (found_any)
+  {
+    WRITE_EVENT(state, EV_SYN, SYN_REPORT, 0);
+    flush_events(state);
+  }
+
+  return 1;
+}
+
+static int reference_type_b_touch_down(internal_state_t* state, int contact, int x, int y, int pressure)
+{
+  if (contact >= state->max_contacts)
+  {
+    return 0;
+  }
+
+  if (state->contacts[contact].enabled)
+  {
+    type_b_touch_panic_reset_all(state);
+  }
+
+  set_contact_enabled(state, contact, 1);
+  state->contacts[contact].tracking_id = next_tracking_id(state);
+  state->active_contacts += 1;
+
+  contact_t* slot = &state->contacts[contact];
+
+  // Added since, as whatever the slot last held may have come from a
+  // real touch.
+  forget_slot_values(slot);
+
+  select_slot(state, contact);
+  WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID,
+    state->contacts[contact].tracking_id);
+
+  // Send BTN_TOUCH on first contact only.
+  if (state->active_contacts == 1 && state->has_key_btn_touch)
+    WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 1);
+
+  if (state->has_touch_major)
+    WRITE_SLOT_EVENT(state, ABS_MT_TOUCH_MAJOR, &slot->sent_touch_major,
+      0x00000006);
+
+  if (state->has_width_major)
+    WRITE_SLOT_EVENT(state, ABS_MT_WIDTH_MAJOR, &slot->sent_width_major,
+      0x00000004);
+
+  if (state->has_pressure)
+    WRITE_SLOT_EVENT(state, ABS_MT_PRESSURE, &slot->sent_pressure, pressure);
+
+  WRITE_SLOT_EVENT(state, ABS_MT_POSITION_X, &slot->sent_x, x);
+  WRITE_SLOT_EVENT(state, ABS_MT_POSITION_Y, &slot->sent_y, y);
+
+  return 1;
+}
+
+static int reference_type_b_touch_move(internal_state_t* state, int contact, int x, int y, int pressure)
+{
+  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  {
+    return 0;
+  }
+
+  contact_t* slot = &state->contacts[contact];
+
+  select_slot(state, contact);
+
+  if (state->has_touch_major)
+    WRITE_SLOT_EVENT(state, ABS_MT_TOUCH_MAJOR, &slot->sent_touch_major,
+      0x00000006);
+
+  if (state->has_width_major)
+    WRITE_SLOT_EVENT(state, ABS_MT_WIDTH_MAJOR, &slot->sent_width_major,
+      0x00000004);
+
+  if (state->has_pressure)
+    WRITE_SLOT_EVENT(state, ABS_MT_PRESSURE, &slot->sent_pressure, pressure);
+
+  WRITE_SLOT_EVENT(state, ABS_MT_POSITION_X, &slot->sent_x, x);
+  WRITE_SLOT_EVENT(state, ABS_MT_POSITION_Y, &slot->sent_y, y);
+
+  return 1;
+}
+
+static int reference_type_b_touch_up(internal_state_t* state, int contact)
+{
+  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  {
+    return 0;
+  }
+
+  set_contact_enabled(state, contact, 0);
+  state->active_contacts -= 1;
+
+  select_slot(state, contact);
+  WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, -1);
+
+  // Send BTN_TOUCH only when no contacts remain.
+  if (state->active_contacts == 0 && state->has_key_btn_touch)
+    WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 0);
+
+  return 1;
+}
+
+static const backend_t reference_type_a_backend = {
+  type_a_touch_down,
+  type_a_touch_move,
+  type_a_touch_up,
+  type_a_touch_panic_reset_all,
+  reference_type_a_commit,
+};
+
+static const backend_t reference_type_b_backend = {
+  reference_type_b_touch_down,
+  reference_type_b_touch_move,
+  reference_type_b_touch_up,
+  type_b_touch_panic_reset_all,
+  type_b_commit,
+};
+
+static int setup_state(internal_state_t* state, int type_b, int caps,
+  int suppress_events)
+{
+  FILE* file = tmpfile();
+
+  if (file == NULL)
+  {
+    perror("tmpfile");
+    return -1;
+  }
+
+  memset(state, 0, sizeof(*state));
+  state->fd = dup(fileno(file));
+  fclose(file);
+
+  state->has_mtslot = type_b;
+  state->has_tracking_id = type_b || (caps & CAP_TRACKING_ID) != 0;
+  state->has_key_btn_touch = (caps & CAP_BTN_TOUCH) != 0;
+  state->has_touch_major = (caps & CAP_TOUCH_MAJOR) != 0;
+  state->has_width_major = (caps & CAP_WIDTH_MAJOR) != 0;
+  state->has_pressure = (caps & CAP_PRESSURE) != 0;
+  state->max_pressure = 255;
+  state->max_x = 1079;
+  state->max_y = 1919;
+  state->max_contacts = TEST_CONTACTS;
+  state->max_tracking_id = 65535;
+  state->suppress_events = suppress_events;
+
+  if (init_contacts(state) != 0)
+    return -1;
+
+  forget_sent_values(state);
+
+  return 0;
+}
+
+static void free_state(internal_state_t* state)
+{
+  close(state->fd);
+  free(state->contacts);
+  free(state->live_contacts);
+}
+
+// A long pseudo-random mix of every command, including downs on contacts
+// that are already down, moves and ups of contacts that aren't, and moves
+// that repeat values, on a small grid so that repeats are common.
+static void play_script(internal_state_t* state)
+{
+  unsigned int seed = 12345;
+  command_t command;
+  int i;
+
+  for (i = 0; i < TEST_STEPS; ++i)
+  {
+    seed = seed * 1103515245 + 12345;
+
+    memset(&command, 0, sizeof(command));
+    command.contact = (seed >> 8) % TEST_CONTACTS;
+    command.x = (seed >> 12) % 4 * 100;
+    command.y = (seed >> 14) % 4 * 100;
+    command.pressure = (seed >> 16) % 2 * 50 + 50;
+
+    switch ((seed >> 20) % 16)
+    {
+      case 0: case 1: case 2:
+        command.type = 'd';
+        break;
+      case 3: case 4: case 5: case 6: case 7: case 8:
+        command.type = 'm';
+        break;
+      case 9: case 10:
+        command.type = 'u';
+        break;
+      case 11:
+        command.type = (seed >> 24) % 8 == 0 ? 'r' : 'c';
+        break;
+      default:
+        command.type = 'c';
+        break;
+    }
+
+    run_command(&command, state);
+  }
+
+  command.type = 'r';
+  run_command(&command, state);
+}
+
+static char* read_events(internal_state_t* state, size_t* length)
+{
+  off_t size = lseek(state->fd, 0, SEEK_END);
+  char* data = malloc(size > 0 ? size : 1);
+
+  if (data == NULL || pread(state->fd, data, size, 0) != size)
+  {
+    perror("reading events");
+    exit(EXIT_FAILURE);
+  }
+
+  *length = size;
+
+  return data;
+}
+
+static int check(int type_b, int caps, int suppress_events)
+{
+  internal_state_t specialized;
+  internal_state_t reference;
+  size_t specialized_length;
+  size_t reference_length;
+  char* specialized_events;
+  char* reference_events;
+  int result = 0;
+
+  if (setup_state(&specialized, type_b, caps, suppress_events) != 0
+      || setup_state(&reference, type_b, caps, suppress_events) != 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  select_backend(&specialized);
+  reference.backend = type_b
+    ? &reference_type_b_backend : &reference_type_a_backend;
+
+  if (specialized.backend
+      != (type_b ? &type_b_backends[caps] : &type_a_backends[caps]))
+  {
+    fprintf(stderr, "Type %c with caps %d: wrong backend selected\n",
+      type_b ? 'B' : 'A', caps);
+    result = -1;
+  }
+
+  play_script(&specialized);
+  play_script(&reference);
+
+  specialized_events = read_events(&specialized, &specialized_length);
+  reference_events = read_events(&reference, &reference_length);
+
+  if (specialized_length == 0 || specialized_length != reference_length
+      || memcmp(specialized_events, reference_events, reference_length) != 0)
+  {
+    fprintf(stderr, "Type %c with caps %d%s: specialized backend wrote %zu "
+      "bytes of events, reference emitters %zu, and they differ\n",
+      type_b ? 'B' : 'A', caps, suppress_events ? "" : " (-a)",
+      specialized_length, reference_length);
+    result = -1;
+  }
+
+  free(specialized_events);
+  free(reference_events);
+  free_state(&specialized);
+  free_state(&reference);
+
+  return result;
+}
+
+int main(void)
+{
+  int failures = 0;
+  int checks = 0;
+  int type_b;
+  int caps;
+  int suppress_events;
+
+  for (type_b = 0; type_b <= 1; ++type_b)
+  {
+    // Type B devices always have tracking IDs.
+    for (caps = 0; caps < (type_b ? 16 : 32); ++caps)
+    {
+      for (suppress_events = 0; suppress_events <= 1; ++suppress_events)
+      {
+        failures += check(type_b, caps, suppress_events) != 0;
+        checks += 1;
+      }
+    }
+  }
+
+  printf("%d of %d backend checks passed\n", checks - failures, checks);
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
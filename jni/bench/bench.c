@@ -0,0 +1,405 @@
+// Replays synthetic command streams through a host build of minitouch and
+// reports throughput and the statistics minitouch collects about itself.
+// Build and run it with `make bench`, which links minitouch against the
+// fake libevdev in this directory and uses /dev/null as the touch device.
+// If /dev/uinput is writable, every scenario is also run with -u, which
+// injects into a real virtual touch screen instead.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct
+{
+  char* data;
+  size_t length;
+  size_t capacity;
+  long commands;
+  long commits;
+} stream_t;
+
+typedef struct
+{
+  const char* name;
+  void (*generate)(stream_t* stream, long scale);
+} scenario_t;
+
+typedef struct
+{
+  const char* name;
+  const char* fake_type;
+  int uinput;
+} device_type_t;
+
+typedef struct
+{
+  unsigned long count;
+  unsigned long long p50;
+  unsigned long long p90;
+  unsigned long long p99;
+  unsigned long long max;
+} metric_t;
+
+static void append(stream_t* stream, const void* data, size_t length)
+{
+  if (stream->length + length > stream->capacity)
+  {
+    stream->capacity = (stream->length + length) * 2;
+    stream->data = realloc(stream->data, stream->capacity);
+
+    if (stream->data == NULL)
+    {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memcpy(stream->data + stream->length, data, length);
+  stream->length += length;
+}
+
+static void text(stream_t* stream, const char* format, ...)
+{
+  char line[128];
+  va_list args;
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  append(stream, line, length);
+
+  stream->commands += 1;
+
+  if (line[0] == 'c')
+    stream->commits += 1;
+}
+
+static void binary(stream_t* stream, char type, int contact, int x, int y,
+  int pressure)
+{
+  unsigned char record[16] = {0};
+  int32_t values[3] = {x, y, pressure};
+  int i;
+
+  record[0] = type;
+  record[1] = contact;
+
+  for (i = 0; i < 3; ++i)
+  {
+    record[4 + i * 4] = values[i] & 0xff;
+    record[5 + i * 4] = (values[i] >> 8) & 0xff;
+    record[6 + i * 4] = (values[i] >> 16) & 0xff;
+    record[7 + i * 4] = (values[i] >> 24) & 0xff;
+  }
+
+  append(stream, record, sizeof(record));
+
+  stream->commands += 1;
+
+  if (type == 'c')
+    stream->commits += 1;
+}
+
+static void generate_taps(stream_t* stream, long scale)
+{
+  long i;
+
+  for (i = 0; i < 20000 * scale; ++i)
+  {
+    text(stream, "d 0 %ld %ld 50\n", i % 1080, i % 1920);
+    text(stream, "c\n");
+    text(stream, "u 0\n");
+    text(stream, "c\n");
+  }
+}
+
+static void generate_ten_fingers(stream_t* stream, long scale)
+{
+  long frame;
+  int contact;
+
+  for (contact = 0; contact < 10; ++contact)
+    text(stream, "d %d %d 100 50\n", contact, contact * 100);
+
+  text(stream, "c\n");
+
+  for (frame = 0; frame < 20000 * scale; ++frame)
+  {
+    for (contact = 0; contact < 10; ++contact)
+      text(stream, "m %d %d %ld 50\n", contact, contact * 100 + frame % 50,
+        100 + frame % 1800);
+
+    text(stream, "c\n");
+  }
+
+  for (contact = 0; contact < 10; ++contact)
+    text(stream, "u %d\n", contact);
+
+  text(stream, "c\n");
+}
+
+static void generate_ten_fingers_binary(stream_t* stream, long scale)
+{
+  long frame;
+  int contact;
+
+  append(stream, "b\n", 2);
+
+  for (contact = 0; contact < 10; ++contact)
+    binary(stream, 'd', contact, contact * 100, 100, 50);
+
+  binary(stream, 'c', 0, 0, 0, 0);
+
+  for (frame = 0; frame < 20000 * scale; ++frame)
+  {
+    for (contact = 0; contact < 10; ++contact)
+      binary(stream, 'm', contact, contact * 100 + frame % 50,
+        100 + frame % 1800, 50);
+
+    binary(stream, 'c', 0, 0, 0, 0);
+  }
+
+  for (contact = 0; contact < 10; ++contact)
+    binary(stream, 'u', contact, 0, 0, 0);
+
+  binary(stream, 'c', 0, 0, 0, 0);
+}
+
+// A long recorded-style script: one contact dragged around with a zero
+// length wait every few frames, which exercises the scheduler as well.
+static void generate_script(stream_t* stream, long scale)
+{
+  long frame;
+
+  text(stream, "d 0 540 960 50\n");
+  text(stream, "c\n");
+
+  for (frame = 0; frame < 200000 * scale; ++frame)
+  {
+    text(stream, "m 0 %ld %ld 50\n", 540 + frame % 200, 960 - frame % 400);
+    text(stream, "c\n");
+
+    if (frame % 16 == 0)
+      text(stream, "w 0\n");
+  }
+
+  text(stream, "u 0\n");
+  text(stream, "c\n");
+}
+
+static const scenario_t scenarios[] = {
+  {"tap", generate_taps},
+  {"ten-finger", generate_ten_fingers},
+  {"ten-finger-bin", generate_ten_fingers_binary},
+  {"script", generate_script},
+};
+
+static double elapsed_seconds(const struct timespec* start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void parse_metric(const char* output, const char* name,
+  metric_t* metric)
+{
+  char pattern[32];
+  const char* line;
+
+  memset(metric, 0, sizeof(*metric));
+  snprintf(pattern, sizeof(pattern), "%% %s ", name);
+
+  if ((line = strstr(output, pattern)) != NULL)
+  {
+    sscanf(line + strlen(pattern), "%lu %llu %llu %llu %llu", &metric->count,
+      &metric->p50, &metric->p90, &metric->p99, &metric->max);
+  }
+}
+
+static double timeval_seconds(const struct timeval* tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Feeds the stream to minitouch on stdin, asks for its statistics at the
+// end and collects everything it prints until it exits. Also reports how
+// much CPU time minitouch itself used, which is less sensitive to the
+// scheduling of the pipe than the elapsed time.
+static int run(const char* minitouch, const device_type_t* type,
+  stream_t* stream, char* output, size_t output_size, double* seconds,
+  double* cpu_seconds)
+{
+  struct rusage usage;
+  int input_pipe[2];
+  int output_pipe[2];
+  struct timespec start;
+  size_t written = 0;
+  size_t received = 0;
+  ssize_t result;
+  pid_t pid;
+  int status;
+
+  if (pipe(input_pipe) < 0 || pipe(output_pipe) < 0)
+  {
+    perror("pipe");
+    return -1;
+  }
+
+  if ((pid = fork()) < 0)
+  {
+    perror("fork");
+    return -1;
+  }
+
+  if (pid == 0)
+  {
+    dup2(input_pipe[0], STDIN_FILENO);
+    dup2(output_pipe[1], STDERR_FILENO);
+    close(input_pipe[0]);
+    close(input_pipe[1]);
+    close(output_pipe[0]);
+    close(output_pipe[1]);
+    setenv("FAKE_EVDEV_TYPE", type->fake_type, 1);
+    execl(minitouch, minitouch, "-d", "/dev/null", "-s", "-i",
+      type->uinput ? "-u" : (char*) NULL, (char*) NULL);
+    perror("execl");
+    _exit(127);
+  }
+
+  close(input_pipe[0]);
+  close(output_pipe[1]);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // The output is tiny, so it can't fill up the pipe while we're writing.
+  while (written < stream->length)
+  {
+    result = write(input_pipe[1], stream->data + written,
+      stream->length - written);
+
+    if (result < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      perror("write");
+      break;
+    }
+
+    written += result;
+  }
+
+  close(input_pipe[1]);
+
+  while ((result = read(output_pipe[0], output + received,
+      output_size - 1 - received)) > 0)
+  {
+    received += result;
+  }
+
+  output[received] = '\0';
+  close(output_pipe[0]);
+
+  wait4(pid, &status, 0, &usage);
+  *seconds = elapsed_seconds(&start);
+  *cpu_seconds = timeval_seconds(&usage.ru_utime)
+    + timeval_seconds(&usage.ru_stime);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    fprintf(stderr, "%s exited abnormally:\n%s", minitouch, output);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  const device_type_t types[] = {
+    {"A", "A", 0},
+    {"B", "B", 0},
+    {"uA", "A", 1},
+    {"uB", "B", 1},
+  };
+  size_t num_types = 2;
+  long scale = 1;
+  size_t i;
+  size_t t;
+  static char output[65536];
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s <minitouch> [<scale>]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (argc > 2)
+  {
+    scale = atol(argv[2]);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (access("/dev/uinput", W_OK) == 0)
+    num_types = sizeof(types) / sizeof(types[0]);
+  else
+    fprintf(stderr, "Note: /dev/uinput is not writable, skipping -u\n");
+
+  printf("%-15s %4s %9s %11s %10s %13s %10s %10s %10s\n",
+    "scenario", "type", "commands", "commands/s", "cpu ns/cmd",
+    "writes/commit", "parse p50", "write p50", "write p99");
+
+  for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i)
+  {
+    stream_t stream = {NULL, 0, 0, 0, 0};
+
+    scenarios[i].generate(&stream, scale);
+
+    // Ask for the statistics in whichever protocol the stream ended up in.
+    if (stream.data[0] == 'b')
+      binary(&stream, '?', 0, 0, 0, 0);
+    else
+      text(&stream, "?\n");
+
+    for (t = 0; t < num_types; ++t)
+    {
+      metric_t parse;
+      metric_t write;
+      double seconds;
+      double cpu_seconds;
+
+      if (run(argv[1], &types[t], &stream, output, sizeof(output),
+          &seconds, &cpu_seconds) != 0)
+      {
+        return EXIT_FAILURE;
+      }
+
+      parse_metric(output, "parse", &parse);
+      parse_metric(output, "write", &write);
+
+      printf("%-15s %4s %9ld %11.0f %10.1f %13.2f %10llu %10llu %10llu\n",
+        scenarios[i].name, types[t].name, stream.commands,
+        stream.commands / seconds, cpu_seconds * 1e9 / stream.commands,
+        stream.commits ? (double) write.count / stream.commits : 0.0,
+        parse.p50, write.p50, write.p99);
+    }
+
+    free(stream.data);
+  }
+
+  return EXIT_SUCCESS;
+}
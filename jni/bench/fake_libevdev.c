@@ -0,0 +1,138 @@
+// A fake libevdev that describes a touch screen regardless of the device
+// node it is given. Combined with `-d /dev/null` it lets minitouch run on
+// any Linux host, with every event written to /dev/null. The reported
+// device can be tweaked with environment variables:
+//
+//   FAKE_EVDEV_TYPE      "A" or "B" (default "B")
+//   FAKE_EVDEV_CONTACTS  number of contacts (default 10)
+//   FAKE_EVDEV_PRESSURE  0 to leave out ABS_MT_PRESSURE (default 1)
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libevdev.h"
+
+struct libevdev
+{
+  int type_b;
+  int contacts;
+  int has_pressure;
+};
+
+static int env_int(const char* name, int fallback)
+{
+  const char* value = getenv(name);
+  return value != NULL ? atoi(value) : fallback;
+}
+
+int libevdev_new_from_fd(int fd, struct libevdev** dev)
+{
+  const char* type = getenv("FAKE_EVDEV_TYPE");
+
+  (void) fd;
+
+  if ((*dev = calloc(1, sizeof(struct libevdev))) == NULL)
+  {
+    return -1;
+  }
+
+  (*dev)->type_b = type == NULL || strcmp(type, "A") != 0;
+  (*dev)->contacts = env_int("FAKE_EVDEV_CONTACTS", 10);
+  (*dev)->has_pressure = env_int("FAKE_EVDEV_PRESSURE", 1);
+
+  return 0;
+}
+
+void libevdev_free(struct libevdev* dev)
+{
+  free(dev);
+}
+
+const char* libevdev_get_name(const struct libevdev* dev)
+{
+  return dev->type_b ? "fake_touch_b" : "fake_touch_a";
+}
+
+int libevdev_get_id_bustype(const struct libevdev* dev)
+{
+  (void) dev;
+  return BUS_VIRTUAL;
+}
+
+int libevdev_get_id_vendor(const struct libevdev* dev)
+{
+  (void) dev;
+  return 0;
+}
+
+int libevdev_get_id_product(const struct libevdev* dev)
+{
+  (void) dev;
+  return 0;
+}
+
+int libevdev_get_id_version(const struct libevdev* dev)
+{
+  (void) dev;
+  return 0;
+}
+
+int libevdev_has_property(const struct libevdev* dev, unsigned int prop)
+{
+  (void) dev;
+  return prop == INPUT_PROP_DIRECT;
+}
+
+int libevdev_has_event_code(const struct libevdev* dev, unsigned int type,
+  unsigned int code)
+{
+  if (type == EV_KEY)
+  {
+    return code == BTN_TOUCH;
+  }
+
+  if (type != EV_ABS)
+  {
+    return 0;
+  }
+
+  switch (code)
+  {
+    case ABS_MT_SLOT:
+      return dev->type_b;
+    case ABS_MT_PRESSURE:
+      return dev->has_pressure;
+    case ABS_MT_TRACKING_ID:
+    case ABS_MT_TOUCH_MAJOR:
+    case ABS_MT_WIDTH_MAJOR:
+    case ABS_MT_POSITION_X:
+    case ABS_MT_POSITION_Y:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+int libevdev_get_abs_minimum(const struct libevdev* dev, unsigned int code)
+{
+  (void) dev;
+  (void) code;
+  return 0;
+}
+
+int libevdev_get_abs_maximum(const struct libevdev* dev, unsigned int code)
+{
+  switch (code)
+  {
+    case ABS_MT_SLOT:
+      return dev->contacts - 1;
+    case ABS_MT_TRACKING_ID:
+      return dev->type_b ? 65535 : dev->contacts - 1;
+    case ABS_MT_POSITION_X:
+      return 1079;
+    case ABS_MT_POSITION_Y:
+      return 1919;
+    default:
+      return 255;
+  }
+}
@@ -0,0 +1,28 @@
+// Just enough of the libevdev API for minitouch to build on a regular Linux
+// host without a real touch device. See fake_libevdev.c.
+
+#ifndef FAKE_LIBEVDEV_H
+#define FAKE_LIBEVDEV_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/input.h>
+
+struct libevdev;
+
+int libevdev_new_from_fd(int fd, struct libevdev** dev);
+void libevdev_free(struct libevdev* dev);
+const char* libevdev_get_name(const struct libevdev* dev);
+int libevdev_get_id_bustype(const struct libevdev* dev);
+int libevdev_get_id_vendor(const struct libevdev* dev);
+int libevdev_get_id_product(const struct libevdev* dev);
+int libevdev_get_id_version(const struct libevdev* dev);
+int libevdev_has_property(const struct libevdev* dev, unsigned int prop);
+int libevdev_has_event_code(const struct libevdev* dev, unsigned int type,
+  unsigned int code);
+int libevdev_get_abs_minimum(const struct libevdev* dev, unsigned int code);
+int libevdev_get_abs_maximum(const struct libevdev* dev, unsigned int code);
+
+#endif
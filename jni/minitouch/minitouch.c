@@ -1,34 +1,83 @@
+#define _GNU_SOURCE
+
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libevdev.h>
-
-#define MAX_SUPPORTED_CONTACTS 10
+#include <linux/uinput.h>
+
+#define MAX_TYPE_A_CONTACTS 10
+#define MAX_BUFFERED_EVENTS 256
+#define INPUT_BUFFER_SIZE 65536
+#define OUTPUT_BUFFER_SIZE 65536
+#define MAX_INPUT_CHUNKS 32
+#define MAX_COMMANDS_PER_TURN 1024
+#define MAX_EPOLL_EVENTS 32
+#define MAX_PROBE_THREADS 8
+#define MAX_DEVICES 8
+#define WRITER_QUEUE_SIZE 1024
+#define RESAMPLE_HISTORY 16
+#define PROXY_BUFFER_SIZE 65536
 #define VERSION 1
 #define DEFAULT_SOCKET_NAME "minitouch"
+#define UINPUT_NAME_PREFIX "minitouch"
+#define UINPUT_MAX_TRACKING_ID 65535
+
+// Older NDK headers predate memfd sealing, which the kernel supports since
+// 3.17. On kernels without it, F_GET_SEALS fails and shared rings are
+// refused.
+#ifndef F_GET_SEALS
+#define F_GET_SEALS (1024 + 10)
+#endif
+#ifndef F_SEAL_SHRINK
+#define F_SEAL_SHRINK 0x0002
+#endif
 
 static int g_verbose = 0;
+static int g_stats_enabled = 0;
 
 static void usage(const char* pname)
 {
   fprintf(stderr,
-    "Usage: %s [-h] [-d <device>] [-n <name>] [-v] [-i] [-f <file>]\n"
+    "Usage: %s [-h] [-d <device>] [-n <name>] [-v] [-i] [-f <file>] [-c <file>] [-s] [-a] [-r <file>] [-m] [-w] [-p <prio>] [-x <cpu>] [-u]\n"
     "  -d <device>: Use the given touch device. Otherwise autodetect.\n"
+    "               Repeat to drive several devices at once.\n"
     "  -n <name>:   Change the name of of the abtract unix domain socket. (%s)\n"
     "  -v:          Verbose output.\n"
     "  -i:          Uses STDIN and doesn't start socket.\n"
     "  -f <file>:   Runs a file with a list of commands, doesn't start socket.\n"
+    "  -c <file>:   Cache the autodetected device in the given file.\n"
+    "  -s:          Collect latency statistics.\n"
+    "  -a:          Send all axes on every move, even if unchanged.\n"
+    "  -r <file>:   Record touches from the device into a script for -f.\n"
+    "  -m:          Merge moves of frames that back up in the input.\n"
+    "  -w:          Write events to the device from a dedicated thread.\n"
+    "  -p <prio>:   Run the writer thread with SCHED_FIFO priority <prio>.\n"
+    "  -x <cpu>:    Pin the writer thread to CPU <cpu>.\n"
+    "  -u:          Inject through a virtual uinput copy of the device.\n"
     "  -h:          Show help.\n",
     pname, DEFAULT_SOCKET_NAME
   );
@@ -41,13 +90,22 @@ typedef struct
   int x;
   int y;
   int pressure;
+  int owned;
+  int sent_touch_major;
+  int sent_width_major;
+  int sent_pressure;
+  int sent_x;
+  int sent_y;
 } contact_t;
 
+struct backend;
+
 typedef struct
 {
   int fd;
   int score;
-  char path[100];
+  char path[FILENAME_MAX];
+  char name[256];
   struct libevdev* evdev;
   int has_mtslot;
   int has_tracking_id;
@@ -62,8 +120,20 @@ typedef struct
   int max_contacts;
   int max_tracking_id;
   int tracking_id;
-  contact_t contacts[MAX_SUPPORTED_CONTACTS];
+  const struct backend* backend;
+  contact_t* contacts;
+  unsigned long* live_contacts;
   int active_contacts;
+  int lifted_contacts;
+  int suppress_events;
+  int coalesce_moves;
+  unsigned long frames_coalesced;
+  int current_slot;
+  unsigned long events_suppressed;
+  struct input_event events[MAX_BUFFERED_EVENTS];
+  int num_events;
+  unsigned long num_flushes;
+  unsigned long syscalls_saved;
 } internal_state_t;
 
 static int is_character_device(const char* devpath)
@@ -88,8 +158,19 @@ static int is_multitouch_device(struct libevdev* evdev)
   return libevdev_has_event_code(evdev, EV_ABS, ABS_MT_POSITION_X);
 }
 
-static int consider_device(const char* devpath, internal_state_t* state)
+typedef struct
+{
+  char path[FILENAME_MAX];
+  int fd;
+  int score;
+  struct libevdev* evdev;
+} probe_t;
+
+// Opens and scores a single device. Only touches the probe itself, so that
+// several devices can be probed at the same time.
+static int probe_device(probe_t* probe)
 {
+  const char* devpath = probe->path;
   int fd = -1;
   struct libevdev* evdev = NULL;
 
@@ -151,11 +232,20 @@ static int consider_device(const char* devpath, internal_state_t* state)
     score += num_slots;
   }
 
+  // Don't pick up the virtual device of another minitouch started with -u.
+  const char* name = libevdev_get_name(evdev);
+
+  if (strncmp(name, UINPUT_NAME_PREFIX, strlen(UINPUT_NAME_PREFIX)) == 0)
+  {
+    fprintf(stderr, "Note: device %s is a minitouch virtual device\n",
+      devpath);
+    goto mismatch;
+  }
+
   // For Blackberry devices, see above.
   // Also some device like SO-03L it has two touch devices, one is for touch
   // one is for side sense which name is 'sec_touchscreen_side'.
   // So add one more check for '_side'. check issue #45 for more info
-  const char* name = libevdev_get_name(evdev);
   if (strstr(name, "key") != NULL || strstr(name, "_side") != NULL)
   {
     score -= 1;
@@ -183,46 +273,106 @@ static int consider_device(const char* devpath, internal_state_t* state)
     score += sqrt(x * y);
   }
 
+  probe->fd = fd;
+  probe->score = score;
+  probe->evdev = evdev;
+
+  return 1;
+
+mismatch:
+  libevdev_free(evdev);
+
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+
+  probe->fd = -1;
+  probe->evdev = NULL;
+
+  return 0;
+}
+
+// Keeps the probed device if it beats the current one, and releases
+// whichever one loses.
+static int adopt_device(probe_t* probe, internal_state_t* state)
+{
+  const char* devpath = probe->path;
+
   if (state->evdev != NULL)
   {
-    if (state->score >= score)
+    if (state->score >= probe->score)
     {
       fprintf(stderr, "Note: device %s was outscored by %s (%d >= %d)\n",
-        devpath, state->path, state->score, score);
-      goto mismatch;
+        devpath, state->path, state->score, probe->score);
+      libevdev_free(probe->evdev);
+      close(probe->fd);
+      return 0;
     }
     else
     {
       fprintf(stderr, "Note: device %s was outscored by %s (%d >= %d)\n",
-        state->path, devpath, score, state->score);
+        state->path, devpath, probe->score, state->score);
+      close(state->fd);
     }
   }
 
   libevdev_free(state->evdev);
 
-  state->fd = fd;
-  state->score = score;
-  strncpy(state->path, devpath, sizeof(state->path));
-  state->evdev = evdev;
+  state->fd = probe->fd;
+  state->score = probe->score;
+  snprintf(state->path, sizeof(state->path), "%s", devpath);
+  state->evdev = probe->evdev;
 
   return 1;
+}
 
-mismatch:
-  libevdev_free(evdev);
+static int consider_device(const char* devpath, internal_state_t* state)
+{
+  probe_t probe;
 
-  if (fd >= 0)
+  snprintf(probe.path, sizeof(probe.path), "%s", devpath);
+
+  if (!probe_device(&probe))
   {
-    close(fd);
+    return 0;
   }
 
-  return 0;
+  return adopt_device(&probe, state);
+}
+
+typedef struct
+{
+  probe_t* probes;
+  int count;
+  int next;
+} probe_queue_t;
+
+static void* probe_worker(void* arg)
+{
+  probe_queue_t* queue = arg;
+  int index;
+
+  while ((index = __sync_fetch_and_add(&queue->next, 1)) < queue->count)
+  {
+    probe_device(&queue->probes[index]);
+  }
+
+  return NULL;
 }
 
+// Some drivers take tens of milliseconds to open or query, so all nodes are
+// probed concurrently. The results are then merged in directory order,
+// which picks exactly the same winner as probing them one by one would.
 static int walk_devices(const char* path, internal_state_t* state)
 {
   DIR* dir;
   struct dirent* ent;
-  char devpath[FILENAME_MAX];
+  probe_queue_t queue = {NULL, 0, 0};
+  int capacity = 0;
+  pthread_t threads[MAX_PROBE_THREADS];
+  int num_threads = 0;
+  int i;
 
   if ((dir = opendir(path)) == NULL)
   {
@@ -237,504 +387,4931 @@ static int walk_devices(const char* path, internal_state_t* state)
       continue;
     }
 
-    snprintf(devpath, FILENAME_MAX, "%s/%s", path, ent->d_name);
+    if (queue.count == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 16;
+      probe_t* probes = realloc(queue.probes, capacity * sizeof(probe_t));
+
+      if (probes == NULL)
+      {
+        perror("allocating probes");
+        break;
+      }
+
+      queue.probes = probes;
+    }
 
-    consider_device(devpath, state);
+    snprintf(queue.probes[queue.count].path, FILENAME_MAX, "%s/%s",
+      path, ent->d_name);
+    queue.count += 1;
   }
 
   closedir(dir);
 
-  return 0;
-}
+  while (num_threads < MAX_PROBE_THREADS && num_threads < queue.count - 1)
+  {
+    if (pthread_create(&threads[num_threads], NULL, probe_worker, &queue) != 0)
+    {
+      break;
+    }
 
-#define WRITE_EVENT(state, type, code, value) _write_event(state, type, #type, code, #code, value)
+    num_threads += 1;
+  }
 
-static int _write_event(internal_state_t* state,
-  uint16_t type, const char* type_name,
-  uint16_t code, const char* code_name,
-  int32_t value)
-{
-  // It seems that most devices do not require the event timestamps at all.
-  // Left here for reference should such a situation arise.
-  //
-  //   timespec ts;
-  //   clock_gettime(CLOCK_MONOTONIC, &ts);
-  //   input_event event = {{ts.tv_sec, ts.tv_nsec / 1000}, type, code, value};
+  // Do our share as well, which also covers the case where no threads
+  // could be started at all.
+  probe_worker(&queue);
 
-  struct input_event event = {{0, 0}, type, code, value};
-  ssize_t result;
-  ssize_t length = (ssize_t) sizeof(event);
+  for (i = 0; i < num_threads; ++i)
+  {
+    pthread_join(threads[i], NULL);
+  }
 
-  if (g_verbose)
-    fprintf(stderr, "%-12s %-20s %08x\n", type_name, code_name, value);
+  for (i = 0; i < queue.count; ++i)
+  {
+    if (queue.probes[i].evdev != NULL)
+    {
+      adopt_device(&queue.probes[i], state);
+    }
+  }
 
-  result = write(state->fd, &event, length);
-  return result - length;
+  free(queue.probes);
+
+  return 0;
 }
 
-static int next_tracking_id(internal_state_t* state)
+static void read_capabilities(internal_state_t* state)
 {
-  if (state->tracking_id < INT_MAX)
+  state->has_mtslot =
+    libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_SLOT);
+  state->has_tracking_id =
+    libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_TRACKING_ID);
+  state->has_key_btn_touch =
+    libevdev_has_event_code(state->evdev, EV_KEY, BTN_TOUCH);
+  state->has_touch_major =
+    libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_TOUCH_MAJOR);
+  state->has_width_major =
+    libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_WIDTH_MAJOR);
+
+  state->has_pressure =
+    libevdev_has_event_code(state->evdev, EV_ABS, ABS_MT_PRESSURE);
+  state->min_pressure = state->has_pressure ?
+    libevdev_get_abs_minimum(state->evdev, ABS_MT_PRESSURE) : 0;
+  state->max_pressure= state->has_pressure ?
+    libevdev_get_abs_maximum(state->evdev, ABS_MT_PRESSURE) : 0;
+
+  state->max_x = libevdev_get_abs_maximum(state->evdev, ABS_MT_POSITION_X);
+  state->max_y = libevdev_get_abs_maximum(state->evdev, ABS_MT_POSITION_Y);
+
+  state->max_tracking_id = state->has_tracking_id
+    ? libevdev_get_abs_maximum(state->evdev, ABS_MT_TRACKING_ID)
+    : INT_MAX;
+
+  if (!state->has_mtslot && state->max_tracking_id == 0)
   {
-    state->tracking_id += 1;
+    // The touch device reports incorrect values. There would be no point
+    // in supporting ABS_MT_TRACKING_ID at all if the maximum value was 0
+    // (i.e. one contact). This happens on Lenovo Yoga Tablet B6000-F,
+    // which actually seems to support ~10 contacts. So, we'll just go with
+    // as many as we can and hope that the system will ignore extra contacts.
+    state->max_tracking_id = MAX_TYPE_A_CONTACTS - 1;
+    fprintf(stderr,
+      "Note: type A device reports a max value of 0 for ABS_MT_TRACKING_ID. "
+      "This means that the device is most likely reporting incorrect "
+      "information. Guessing %d.\n",
+      state->max_tracking_id
+    );
   }
-  else
+
+  state->max_contacts = state->has_mtslot
+    ? libevdev_get_abs_maximum(state->evdev, ABS_MT_SLOT) + 1
+    : (state->has_tracking_id ? state->max_tracking_id + 1 : 2);
+
+  strncpy(state->name, libevdev_get_name(state->evdev),
+    sizeof(state->name) - 1);
+}
+
+// Describes a typical phone screen, for use with -u when there's no device
+// to copy.
+static void preset_capabilities(internal_state_t* state)
+{
+  state->has_mtslot = 1;
+  state->has_tracking_id = 1;
+  state->has_key_btn_touch = 1;
+  state->has_touch_major = 1;
+  state->has_width_major = 0;
+  state->has_pressure = 1;
+  state->min_pressure = 0;
+  state->max_pressure = 255;
+  state->max_x = 1079;
+  state->max_y = 1919;
+  state->max_tracking_id = UINPUT_MAX_TRACKING_ID;
+  state->max_contacts = 10;
+  state->fd = -1;
+  snprintf(state->name, sizeof(state->name), "preset");
+}
+
+static void set_uinput_axis(int fd, struct uinput_user_dev* dev, int code,
+  struct libevdev* evdev, int min, int max)
+{
+  if (ioctl(fd, UI_SET_ABSBIT, code) < 0)
+    perror("UI_SET_ABSBIT");
+
+  // Keep the original range of axes that we don't otherwise care about.
+  if (evdev != NULL && libevdev_has_event_code(evdev, EV_ABS, code))
   {
-    state->tracking_id = 0;
+    min = libevdev_get_abs_minimum(evdev, code);
+    max = libevdev_get_abs_maximum(evdev, code);
   }
 
-  return state->tracking_id;
+  dev->absmin[code] = min;
+  dev->absmax[code] = max;
 }
 
-static int type_a_commit(internal_state_t* state)
+// Replaces the device with a virtual touch screen of our own, created
+// through uinput with the same size, pressure range and ids. Whatever the
+// original device is like, the copy is a Type B device with a slot for
+// every contact, and events written to it go straight to its own queue
+// instead of through the driver of the original device.
+static int create_uinput_device(internal_state_t* state)
 {
-  int contact;
-  int found_any = 0;
+  const char* paths[] = {"/dev/uinput", "/dev/input/uinput"};
+  struct uinput_user_dev dev;
+  size_t i;
+  int fd = -1;
 
-  for (contact = 0; contact < state->max_contacts; ++contact)
+  for (i = 0; i < sizeof(paths) / sizeof(paths[0]) && fd < 0; ++i)
   {
-    switch (state->contacts[contact].enabled)
-    {
-      case 1: // WENT_DOWN
-        found_any = 1;
-
-        state->active_contacts += 1;
+    fd = open(paths[i], O_WRONLY);
+  }
 
-        if (state->has_tracking_id)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+  if (fd < 0)
+  {
+    perror("opening uinput");
+    return -1;
+  }
 
-        // Send BTN_TOUCH on first contact only.
-        if (state->active_contacts == 1 && state->has_key_btn_touch)
-          WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 1);
+  memset(&dev, 0, sizeof(dev));
+  snprintf(dev.name, sizeof(dev.name), "%s %s", UINPUT_NAME_PREFIX,
+    state->name);
+  dev.id.bustype = BUS_VIRTUAL;
 
-        if (state->has_touch_major)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+  if (state->evdev != NULL)
+  {
+    dev.id.vendor = libevdev_get_id_vendor(state->evdev);
+    dev.id.product = libevdev_get_id_product(state->evdev);
+    dev.id.version = libevdev_get_id_version(state->evdev);
+  }
 
-        if (state->has_width_major)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+  if (ioctl(fd, UI_SET_EVBIT, EV_SYN) < 0
+      || ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0
+      || ioctl(fd, UI_SET_EVBIT, EV_ABS) < 0
+      || ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH) < 0)
+  {
+    perror("setting up uinput device");
+    close(fd);
+    return -1;
+  }
 
-        if (state->has_pressure)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, state->contacts[contact].pressure);
+#ifdef UI_SET_PROPBIT
+  if (ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT) < 0)
+    perror("UI_SET_PROPBIT");
+#endif
 
-        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, state->contacts[contact].x);
-        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, state->contacts[contact].y);
+  set_uinput_axis(fd, &dev, ABS_MT_SLOT, NULL, 0, state->max_contacts - 1);
+  set_uinput_axis(fd, &dev, ABS_MT_TRACKING_ID, NULL, 0,
+    UINPUT_MAX_TRACKING_ID);
+  set_uinput_axis(fd, &dev, ABS_MT_POSITION_X, NULL, 0, state->max_x);
+  set_uinput_axis(fd, &dev, ABS_MT_POSITION_Y, NULL, 0, state->max_y);
 
-        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+  if (state->has_pressure)
+    set_uinput_axis(fd, &dev, ABS_MT_PRESSURE, NULL, state->min_pressure,
+      state->max_pressure);
 
-        state->contacts[contact].enabled = 2;
-        break;
-      case 2: // MOVED
-        found_any = 1;
+  if (state->has_touch_major)
+    set_uinput_axis(fd, &dev, ABS_MT_TOUCH_MAJOR, state->evdev, 0, 255);
 
-        if (state->has_tracking_id)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+  if (state->has_width_major)
+    set_uinput_axis(fd, &dev, ABS_MT_WIDTH_MAJOR, state->evdev, 0, 255);
 
-        if (state->has_touch_major)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+  if (write(fd, &dev, sizeof(dev)) != sizeof(dev)
+      || ioctl(fd, UI_DEV_CREATE) < 0)
+  {
+    perror("creating uinput device");
+    close(fd);
+    return -1;
+  }
 
-        if (state->has_width_major)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+  if (state->fd >= 0)
+    close(state->fd);
 
-        if (state->has_pressure)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, state->contacts[contact].pressure);
+  libevdev_free(state->evdev);
 
-        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, state->contacts[contact].x);
-        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, state->contacts[contact].y);
+  state->evdev = NULL;
+  state->fd = fd;
+  state->has_mtslot = 1;
+  state->has_tracking_id = 1;
+  state->has_key_btn_touch = 1;
+  state->max_tracking_id = UINPUT_MAX_TRACKING_ID;
+  snprintf(state->path, sizeof(state->path), "%s", paths[i - 1]);
+  snprintf(state->name, sizeof(state->name), "%s", dev.name);
 
-        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
-        break;
-      case 3: // WENT_UP
-        found_any = 1;
+  return 0;
+}
 
-        state->active_contacts -= 1;
+// The device cache remembers the winner of a full scan together with
+// everything we would otherwise read from libevdev, so that subsequent
+// starts only need to open a single node. The entry is validated against
+// the node's name, ids and axis ranges, which are cheap to query, and we
+// fall back to a full scan on any mismatch.
+#define DEVICE_CACHE_VERSION 1
 
-        if (state->has_tracking_id)
-          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+typedef struct
+{
+  char name[256];
+  struct input_id id;
+  int max_x;
+  int max_y;
+} device_identity_t;
 
-        // Send BTN_TOUCH only when no contacts remain.
-        if (state->active_contacts == 0 && state->has_key_btn_touch)
-          WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 0);
+static int read_device_identity(int fd, device_identity_t* identity)
+{
+  struct input_absinfo absinfo;
 
-        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+  memset(identity, 0, sizeof(*identity));
 
-        state->contacts[contact].enabled = 0;
-        break;
-    }
+  if (ioctl(fd, EVIOCGNAME(sizeof(identity->name) - 1), identity->name) < 0
+      || ioctl(fd, EVIOCGID, &identity->id) < 0)
+  {
+    return -1;
   }
 
-  if (found_any)
-    WRITE_EVENT(state, EV_SYN, SYN_REPORT, 0);
-
-  return 1;
-}
+  if (ioctl(fd, EVIOCGABS(ABS_MT_POSITION_X), &absinfo) < 0)
+  {
+    return -1;
+  }
 
-static int type_a_touch_panic_reset_all(internal_state_t* state)
-{
-  int contact;
+  identity->max_x = absinfo.maximum;
 
-  for (contact = 0; contact < state->max_contacts; ++contact)
+  if (ioctl(fd, EVIOCGABS(ABS_MT_POSITION_Y), &absinfo) < 0)
   {
-    switch (state->contacts[contact].enabled)
-    {
-      case 1: // WENT_DOWN
-      case 2: // MOVED
-        // Force everything to WENT_UP
-        state->contacts[contact].enabled = 3;
-        break;
-    }
+    return -1;
   }
 
-  return type_a_commit(state);
+  identity->max_y = absinfo.maximum;
+
+  return 0;
 }
 
-static int type_a_touch_down(internal_state_t* state, int contact, int x, int y, int pressure)
+static int load_device_cache(const char* cache_file, internal_state_t* state)
 {
-  if (contact >= state->max_contacts)
+  FILE* cache;
+  int version;
+  device_identity_t cached;
+  device_identity_t actual;
+  int fd = -1;
+
+  if ((cache = fopen(cache_file, "r")) == NULL)
   {
     return 0;
   }
 
-  if (state->contacts[contact].enabled)
+  memset(&cached, 0, sizeof(cached));
+
+  if (fscanf(cache, "minitouch-cache %d\n", &version) != 1
+      || version != DEVICE_CACHE_VERSION
+      || fgets(state->path, sizeof(state->path), cache) == NULL
+      || fgets(cached.name, sizeof(cached.name), cache) == NULL
+      || fscanf(cache, "%hx %hx %hx %hx\n", &cached.id.bustype,
+        &cached.id.vendor, &cached.id.product, &cached.id.version) != 4
+      || fscanf(cache, "%d %d %d %d %d %d %d %d %d %d %d %d %d",
+        &state->score, &state->has_mtslot, &state->has_tracking_id,
+        &state->has_key_btn_touch, &state->has_touch_major,
+        &state->has_width_major, &state->has_pressure,
+        &state->min_pressure, &state->max_pressure,
+        &state->max_x, &state->max_y, &state->max_contacts,
+        &state->max_tracking_id) != 13)
   {
-    type_a_touch_panic_reset_all(state);
+    fprintf(stderr, "Note: ignoring malformed device cache %s\n", cache_file);
+    goto mismatch;
   }
 
-  state->contacts[contact].enabled = 1;
-  state->contacts[contact].x = x;
-  state->contacts[contact].y = y;
-  state->contacts[contact].pressure = pressure;
-
-  return 1;
-}
+  state->path[strcspn(state->path, "\n")] = '\0';
+  cached.name[strcspn(cached.name, "\n")] = '\0';
+  cached.max_x = state->max_x;
+  cached.max_y = state->max_y;
 
-static int type_a_touch_move(internal_state_t* state, int contact, int x, int y, int pressure)
-{
-  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  if (!is_character_device(state->path))
   {
-    return 0;
+    goto mismatch;
   }
 
-  state->contacts[contact].enabled = 2;
-  state->contacts[contact].x = x;
-  state->contacts[contact].y = y;
-  state->contacts[contact].pressure = pressure;
-
-  return 1;
-}
+  if ((fd = open(state->path, O_RDWR)) < 0)
+  {
+    perror("open");
+    goto mismatch;
+  }
 
-static int type_a_touch_up(internal_state_t* state, int contact)
-{
-  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  if (read_device_identity(fd, &actual) != 0
+      || strcmp(actual.name, cached.name) != 0
+      || memcmp(&actual.id, &cached.id, sizeof(actual.id)) != 0
+      || actual.max_x != cached.max_x
+      || actual.max_y != cached.max_y)
   {
-    return 0;
+    fprintf(stderr, "Note: device cache %s is stale\n", cache_file);
+    goto mismatch;
   }
 
-  state->contacts[contact].enabled = 3;
+  fclose(cache);
 
-  return 1;
-}
+  state->fd = fd;
+  snprintf(state->name, sizeof(state->name), "%s", cached.name);
 
-static int type_b_commit(internal_state_t* state)
-{
-  WRITE_EVENT(state, EV_SYN, SYN_REPORT, 0);
+  fprintf(stderr, "Using cached touch device %s\n", state->path);
 
   return 1;
-}
 
-static int type_b_touch_panic_reset_all(internal_state_t* state)
-{
-  int contact;
-  int found_any = 0;
+mismatch:
+  fclose(cache);
 
-  for (contact = 0; contact < state->max_contacts; ++contact)
+  if (fd >= 0)
   {
-    if (state->contacts[contact].enabled)
-    {
-      state->contacts[contact].enabled = 0;
-      found_any = 1;
-    }
+    close(fd);
   }
 
-  return found_any ? type_b_commit(state) : 1;
+  // Don't leave anything half-loaded behind for the full scan.
+  memset(state, 0, sizeof(*state));
+
+  return 0;
 }
 
-static int type_b_touch_down(internal_state_t* state, int contact, int x, int y, int pressure)
+static void save_device_cache(const char* cache_file, internal_state_t* state)
 {
-  if (contact >= state->max_contacts)
+  char tmp_file[FILENAME_MAX];
+  FILE* cache;
+
+  snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", cache_file);
+
+  if ((cache = fopen(tmp_file, "w")) == NULL)
   {
-    return 0;
+    fprintf(stderr, "Unable to write device cache '%s': %s\n",
+      tmp_file, strerror(errno));
+    return;
   }
 
-  if (state->contacts[contact].enabled)
+  fprintf(cache, "minitouch-cache %d\n", DEVICE_CACHE_VERSION);
+  fprintf(cache, "%s\n", state->path);
+  fprintf(cache, "%s\n", libevdev_get_name(state->evdev));
+  fprintf(cache, "%x %x %x %x\n",
+    libevdev_get_id_bustype(state->evdev),
+    libevdev_get_id_vendor(state->evdev),
+    libevdev_get_id_product(state->evdev),
+    libevdev_get_id_version(state->evdev));
+  fprintf(cache, "%d %d %d %d %d %d %d %d %d %d %d %d %d\n",
+    state->score, state->has_mtslot, state->has_tracking_id,
+    state->has_key_btn_touch, state->has_touch_major,
+    state->has_width_major, state->has_pressure,
+    state->min_pressure, state->max_pressure,
+    state->max_x, state->max_y, state->max_contacts,
+    state->max_tracking_id);
+
+  if (fclose(cache) != 0 || rename(tmp_file, cache_file) != 0)
   {
-    type_b_touch_panic_reset_all(state);
+    fprintf(stderr, "Unable to write device cache '%s': %s\n",
+      cache_file, strerror(errno));
+    unlink(tmp_file);
   }
+}
 
-  state->contacts[contact].enabled = 1;
-  state->contacts[contact].tracking_id = next_tracking_id(state);
-  state->active_contacts += 1;
+// Latency histograms. Values are in nanoseconds and bucketed by their
+// highest set bit plus the two bits below it, which keeps the error of any
+// reported percentile under 25% while needing only a handful of buckets.
+// Recording is lock-free so that it may happen from any thread.
+#define HISTOGRAM_BUCKETS 256
 
-  WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
-  WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID,
-    state->contacts[contact].tracking_id);
+typedef struct
+{
+  unsigned long count;
+  unsigned long long max;
+  unsigned long buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
 
-  // Send BTN_TOUCH on first contact only.
-  if (state->active_contacts == 1 && state->has_key_btn_touch)
-    WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 1);
+typedef struct
+{
+  histogram_t parse;
+  histogram_t queue;
+  histogram_t write;
+  histogram_t commit;
+  long long last_commit_ns;
+} stats_t;
 
-  if (state->has_touch_major)
-    WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+static stats_t g_stats;
 
-  if (state->has_width_major)
-    WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+static long long monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-  if (state->has_pressure)
-    WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, pressure);
+static int histogram_bucket(unsigned long long value)
+{
+  int msb;
 
-  WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, x);
-  WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, y);
+  if (value < 4)
+  {
+    return value;
+  }
 
-  return 1;
+  msb = 63 - __builtin_clzll(value);
+
+  return (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
 }
 
-static int type_b_touch_move(internal_state_t* state, int contact, int x, int y, int pressure)
+static unsigned long long histogram_bucket_limit(int bucket)
 {
-  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  int msb;
+
+  if (bucket < 4)
+  {
+    return bucket;
+  }
+
+  msb = bucket / 4 + 1;
+
+  return ((unsigned long long) (4 + bucket % 4) << (msb - 2))
+    + (1ULL << (msb - 2)) - 1;
+}
+
+static void histogram_record(histogram_t* histogram, long long value)
+{
+  unsigned long long max;
+
+  if (value < 0)
+  {
+    value = 0;
+  }
+
+  __sync_fetch_and_add(&histogram->buckets[histogram_bucket(value)], 1);
+  __sync_fetch_and_add(&histogram->count, 1);
+
+  while ((max = histogram->max) < (unsigned long long) value)
+  {
+    __sync_bool_compare_and_swap(&histogram->max, max, value);
+  }
+}
+
+static unsigned long long histogram_percentile(const histogram_t* histogram,
+  int percent)
+{
+  unsigned long long wanted = (histogram->count * percent + 99) / 100;
+  unsigned long long seen = 0;
+  int bucket;
+
+  for (bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+  {
+    seen += histogram->buckets[bucket];
+
+    if (seen >= wanted && seen > 0)
+    {
+      unsigned long long limit = histogram_bucket_limit(bucket);
+      return limit < histogram->max ? limit : histogram->max;
+    }
+  }
+
+  return 0;
+}
+
+// Replies are collected per client and written out without blocking, so
+// that a client that doesn't read them can't hold up everyone else. One
+// that lets them pile up beyond the buffer is dropped instead.
+typedef struct
+{
+  int fd;
+  int failed;
+  int overflowed;
+  size_t start;
+  size_t end;
+  char data[OUTPUT_BUFFER_SIZE];
+} output_buffer_t;
+
+static void output_printf(output_buffer_t* output, const char* format, ...)
+{
+  va_list args;
+  int length;
+
+  if (output->failed || output->overflowed)
+  {
+    return;
+  }
+
+  if (output->start > 0)
+  {
+    memmove(output->data, output->data + output->start,
+      output->end - output->start);
+    output->end -= output->start;
+    output->start = 0;
+  }
+
+  va_start(args, format);
+  length = vsnprintf(output->data + output->end,
+    sizeof(output->data) - output->end, format, args);
+  va_end(args);
+
+  if (length < 0 || (size_t) length >= sizeof(output->data) - output->end)
+  {
+    fprintf(stderr, "Dropping client %d, which isn't reading its replies\n",
+      output->fd);
+    output->overflowed = 1;
+    return;
+  }
+
+  output->end += length;
+}
+
+static int output_pending(const output_buffer_t* output)
+{
+  return !output->failed && output->start < output->end;
+}
+
+// Writes out as much as the fd takes without blocking. Replies to a client
+// that has gone away are thrown away.
+static void flush_output(output_buffer_t* output)
+{
+  while (output_pending(output))
+  {
+    ssize_t written = write(output->fd, output->data + output->start,
+      output->end - output->start);
+
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+
+      if (errno != EPIPE && errno != ECONNRESET)
+        perror("writing replies");
+
+      output->failed = 1;
+      break;
+    }
+
+    output->start += written;
+  }
+
+  output->start = output->end = 0;
+}
+
+static void write_histogram(output_buffer_t* output, const char* name,
+  const histogram_t* histogram)
+{
+  output_printf(output, "%% %s %lu %llu %llu %llu %llu\n", name, histogram->count,
+    histogram_percentile(histogram, 50),
+    histogram_percentile(histogram, 90),
+    histogram_percentile(histogram, 99),
+    histogram->max);
+}
+
+static void write_stats(output_buffer_t* output)
+{
+  write_histogram(output, "parse", &g_stats.parse);
+  write_histogram(output, "queue", &g_stats.queue);
+  write_histogram(output, "write", &g_stats.write);
+  write_histogram(output, "commit", &g_stats.commit);
+}
+
+#define WRITE_EVENT(state, type, code, value) _write_event(state, type, #type, code, #code, value)
+
+// Writes all staged events to the device in a single syscall. The kernel
+// handles each input_event in the buffer as if it had been written on its
+// own, so batching does not change what the device sees.
+static int flush_events(internal_state_t* state)
+{
+  char* cursor = (char*) state->events;
+  size_t remaining = state->num_events * sizeof(struct input_event);
+  int result = 0;
+
+  if (state->num_events == 0)
   {
     return 0;
   }
 
-  WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
+  long long start_ns = g_stats_enabled ? monotonic_ns() : 0;
 
-  if (state->has_touch_major)
-    WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+  while (remaining > 0)
+  {
+    ssize_t written = write(state->fd, cursor, remaining);
 
-  if (state->has_width_major)
-    WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
 
-  if (state->has_pressure)
-    WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, pressure);
+      perror("writing events");
+      result = -1;
+      break;
+    }
 
-  WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, x);
-  WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, y);
+    cursor += written;
+    remaining -= written;
+  }
 
-  return 1;
+  if (g_stats_enabled)
+    histogram_record(&g_stats.write, monotonic_ns() - start_ns);
+
+  state->num_flushes += 1;
+  state->syscalls_saved += state->num_events - 1;
+  state->num_events = 0;
+
+  // The real touch driver shares the slot state with us, and may have
+  // switched slots since. The first slot event after a flush must always
+  // be sent.
+  state->current_slot = -1;
+
+  return result;
 }
 
-static int type_b_touch_up(internal_state_t* state, int contact)
+static int _write_event(internal_state_t* state,
+  uint16_t type, const char* type_name,
+  uint16_t code, const char* code_name,
+  int32_t value)
 {
-  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  // The kernel stamps injected events with its own time, whatever we put
+  // in here, so there's no point in filling in the timestamps.
+  struct input_event event = {{0, 0}, type, code, value};
+
+  if (g_verbose)
+    fprintf(stderr, "%-12s %-20s %08x\n", type_name, code_name, value);
+
+  // Events are staged until the next SYN_REPORT. Should a single frame
+  // ever outgrow the buffer, send what we have so far and keep going.
+  if (state->num_events == MAX_BUFFERED_EVENTS)
+  {
+    if (flush_events(state) != 0)
+      return -1;
+  }
+
+  state->events[state->num_events++] = event;
+
+  return 0;
+}
+
+// Type B devices keep the value of every axis per slot, and the kernel
+// already drops events that don't change anything. Sending them in the
+// first place is just wasted effort, so we remember what we've sent to
+// each slot and skip the repeats, unless told otherwise.
+#define WRITE_SLOT_EVENT(state, code, sent, value) _write_slot_event(state, code, #code, sent, value)
+
+static int _write_slot_event(internal_state_t* state,
+  uint16_t code, const char* code_name,
+  int* sent, int32_t value)
+{
+  if (state->suppress_events && *sent == value)
   {
+    state->events_suppressed += 1;
     return 0;
   }
 
-  state->contacts[contact].enabled = 0;
-  state->contacts[contact].enabled = 0;
-  state->active_contacts -= 1;
+  *sent = value;
 
-  WRITE_EVENT(state, EV_ABS, ABS_MT_SLOT, contact);
-  WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, -1);
+  return _write_event(state, EV_ABS, "EV_ABS", code, code_name, value);
+}
 
-  // Send BTN_TOUCH only when no contacts remain.
-  if (state->active_contacts == 0 && state->has_key_btn_touch)
-    WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 0);
+static int select_slot(internal_state_t* state, int contact)
+{
+  return WRITE_SLOT_EVENT(state, ABS_MT_SLOT, &state->current_slot, contact);
+}
 
-  return 1;
+static void forget_slot_values(contact_t* slot)
+{
+  slot->sent_touch_major = INT_MIN;
+  slot->sent_width_major = INT_MIN;
+  slot->sent_pressure = INT_MIN;
+  slot->sent_x = INT_MIN;
+  slot->sent_y = INT_MIN;
 }
 
-static int touch_down(internal_state_t* state, int contact, int x, int y, int pressure)
+static void forget_sent_values(internal_state_t* state)
 {
-  if (state->has_mtslot)
+  int contact;
+
+  state->current_slot = -1;
+
+  for (contact = 0; contact < state->max_contacts; ++contact)
+  {
+    forget_slot_values(&state->contacts[contact]);
+  }
+}
+
+// Contacts that are down or have a pending change are also tracked in a
+// bitmap, so that commits and resets only need to visit those instead of
+// every contact the device supports.
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+static int init_contacts(internal_state_t* state)
+{
+  size_t words = (state->max_contacts + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+  state->contacts = calloc(state->max_contacts, sizeof(contact_t));
+  state->live_contacts = calloc(words, sizeof(unsigned long));
+
+  if (state->contacts == NULL || state->live_contacts == NULL)
+  {
+    perror("allocating contacts");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void set_contact_enabled(internal_state_t* state, int contact,
+  int enabled)
+{
+  unsigned long bit = 1UL << (contact % BITS_PER_WORD);
+
+  state->contacts[contact].enabled = enabled;
+
+  if (enabled)
+    state->live_contacts[contact / BITS_PER_WORD] |= bit;
+  else
+    state->live_contacts[contact / BITS_PER_WORD] &= ~bit;
+}
+
+// Returns the first live contact at or after the given one, or -1.
+static int next_live_contact(const internal_state_t* state, int contact)
+{
+  size_t words = (state->max_contacts + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  size_t word = contact / BITS_PER_WORD;
+  unsigned long bits;
+
+  if (contact >= state->max_contacts)
+  {
+    return -1;
+  }
+
+  bits = state->live_contacts[word] & (~0UL << (contact % BITS_PER_WORD));
+
+  while (bits == 0)
+  {
+    if (++word == words)
+    {
+      return -1;
+    }
+
+    bits = state->live_contacts[word];
+  }
+
+  return word * BITS_PER_WORD + __builtin_ctzl(bits);
+}
+
+static int next_tracking_id(internal_state_t* state)
+{
+  if (state->tracking_id < INT_MAX)
   {
-    return type_b_touch_down(state, contact, x, y, pressure);
+    state->tracking_id += 1;
   }
   else
   {
-    return type_a_touch_down(state, contact, x, y, pressure);
+    state->tracking_id = 0;
   }
+
+  return state->tracking_id;
 }
 
-static int touch_move(internal_state_t* state, int contact, int x, int y, int pressure)
+// Every device type and set of capabilities gets a backend of its own,
+// selected once the device is known. Type B devices always have tracking
+// IDs.
+typedef struct backend
 {
-  if (state->has_mtslot)
+  int (*touch_down)(internal_state_t* state, int contact, int x, int y,
+    int pressure);
+  int (*touch_move)(internal_state_t* state, int contact, int x, int y,
+    int pressure);
+  int (*touch_up)(internal_state_t* state, int contact);
+  int (*touch_panic_reset_all)(internal_state_t* state);
+  int (*commit)(internal_state_t* state);
+} backend_t;
+
+// The emitters below are only ever called with a constant set of
+// capabilities, through the backends generated further down. Since they
+// are always inlined, the compiler drops the checks for whatever a device
+// lacks, and none of them are left in the injection path at runtime.
+#define CAP_BTN_TOUCH 1
+#define CAP_TOUCH_MAJOR 2
+#define CAP_WIDTH_MAJOR 4
+#define CAP_PRESSURE 8
+#define CAP_TRACKING_ID 16
+
+#define EMITTER static inline __attribute__((always_inline))
+
+EMITTER int type_a_commit(internal_state_t* state, int caps)
+{
+  int contact;
+  int found_any = 0;
+
+  for (contact = next_live_contact(state, 0); contact >= 0;
+      contact = next_live_contact(state, contact + 1))
+  {
+    switch (state->contacts[contact].enabled)
+    {
+      case 1: // WENT_DOWN
+        found_any = 1;
+
+        state->active_contacts += 1;
+
+        if ((caps & CAP_TRACKING_ID))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+
+        // Send BTN_TOUCH on first contact only.
+        if (state->active_contacts == 1 && (caps & CAP_BTN_TOUCH))
+          WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 1);
+
+        if ((caps & CAP_TOUCH_MAJOR))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+
+        if ((caps & CAP_WIDTH_MAJOR))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+
+        if ((caps & CAP_PRESSURE))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, state->contacts[contact].pressure);
+
+        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, state->contacts[contact].x);
+        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, state->contacts[contact].y);
+
+        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+
+        set_contact_enabled(state, contact, 2);
+        break;
+      case 2: // MOVED
+        found_any = 1;
+
+        if ((caps & CAP_TRACKING_ID))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+
+        if ((caps & CAP_TOUCH_MAJOR))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TOUCH_MAJOR, 0x00000006);
+
+        if ((caps & CAP_WIDTH_MAJOR))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_WIDTH_MAJOR, 0x00000004);
+
+        if ((caps & CAP_PRESSURE))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_PRESSURE, state->contacts[contact].pressure);
+
+        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_X, state->contacts[contact].x);
+        WRITE_EVENT(state, EV_ABS, ABS_MT_POSITION_Y, state->contacts[contact].y);
+
+        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+        break;
+      case 3: // WENT_UP
+        found_any = 1;
+
+        state->active_contacts -= 1;
+
+        if ((caps & CAP_TRACKING_ID))
+          WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, contact);
+
+        // Send BTN_TOUCH only when no contacts remain.
+        if (state->active_contacts == 0 && (caps & CAP_BTN_TOUCH))
+          WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 0);
+
+        WRITE_EVENT(state, EV_SYN, SYN_MT_REPORT, 0);
+
+        set_contact_enabled(state, contact, 0);
+        break;
+    }
+  }
+
+  if (found_any)
+  {
+    WRITE_EVENT(state, EV_SYN, SYN_REPORT, 0);
+    flush_events(state);
+  }
+
+  return 1;
+}
+
+static int type_a_touch_panic_reset_all(internal_state_t* state)
+{
+  int contact;
+
+  for (contact = next_live_contact(state, 0); contact >= 0;
+      contact = next_live_contact(state, contact + 1))
+  {
+    switch (state->contacts[contact].enabled)
+    {
+      case 1: // WENT_DOWN
+      case 2: // MOVED
+        // Force everything to WENT_UP
+        set_contact_enabled(state, contact, 3);
+        break;
+    }
+  }
+
+  return state->backend->commit(state);
+}
+
+static int type_a_touch_down(internal_state_t* state, int contact, int x, int y, int pressure)
+{
+  if (contact >= state->max_contacts)
+  {
+    return 0;
+  }
+
+  if (state->contacts[contact].enabled)
+  {
+    type_a_touch_panic_reset_all(state);
+  }
+
+  set_contact_enabled(state, contact, 1);
+  state->contacts[contact].x = x;
+  state->contacts[contact].y = y;
+  state->contacts[contact].pressure = pressure;
+
+  return 1;
+}
+
+static int type_a_touch_move(internal_state_t* state, int contact, int x, int y, int pressure)
+{
+  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  {
+    return 0;
+  }
+
+  set_contact_enabled(state, contact, 2);
+  state->contacts[contact].x = x;
+  state->contacts[contact].y = y;
+  state->contacts[contact].pressure = pressure;
+
+  return 1;
+}
+
+static int type_a_touch_up(internal_state_t* state, int contact)
+{
+  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  {
+    return 0;
+  }
+
+  set_contact_enabled(state, contact, 3);
+
+  return 1;
+}
+
+static int type_b_commit(internal_state_t* state)
+{
+  WRITE_EVENT(state, EV_SYN, SYN_REPORT, 0);
+  flush_events(state);
+
+  return 1;
+}
+
+static int type_b_touch_panic_reset_all(internal_state_t* state)
+{
+  int contact;
+  int found_any = 0;
+
+  for (contact = next_live_contact(state, 0); contact >= 0;
+      contact = next_live_contact(state, contact + 1))
+  {
+    set_contact_enabled(state, contact, 0);
+    found_any = 1;
+  }
+
+  return found_any ? type_b_commit(state) : 1;
+}
+
+EMITTER int type_b_touch_down(internal_state_t* state, int caps, int contact, int x, int y, int pressure)
+{
+  if (contact >= state->max_contacts)
+  {
+    return 0;
+  }
+
+  if (state->contacts[contact].enabled)
+  {
+    type_b_touch_panic_reset_all(state);
+  }
+
+  set_contact_enabled(state, contact, 1);
+  state->contacts[contact].tracking_id = next_tracking_id(state);
+  state->active_contacts += 1;
+
+  contact_t* slot = &state->contacts[contact];
+
+  // Whatever the slot last held may have come from a real touch since, so
+  // a new contact always starts out with all of its values.
+  forget_slot_values(slot);
+
+  select_slot(state, contact);
+  WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID,
+    state->contacts[contact].tracking_id);
+
+  // Send BTN_TOUCH on first contact only.
+  if (state->active_contacts == 1 && (caps & CAP_BTN_TOUCH))
+    WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 1);
+
+  if ((caps & CAP_TOUCH_MAJOR))
+    WRITE_SLOT_EVENT(state, ABS_MT_TOUCH_MAJOR, &slot->sent_touch_major,
+      0x00000006);
+
+  if ((caps & CAP_WIDTH_MAJOR))
+    WRITE_SLOT_EVENT(state, ABS_MT_WIDTH_MAJOR, &slot->sent_width_major,
+      0x00000004);
+
+  if ((caps & CAP_PRESSURE))
+    WRITE_SLOT_EVENT(state, ABS_MT_PRESSURE, &slot->sent_pressure, pressure);
+
+  WRITE_SLOT_EVENT(state, ABS_MT_POSITION_X, &slot->sent_x, x);
+  WRITE_SLOT_EVENT(state, ABS_MT_POSITION_Y, &slot->sent_y, y);
+
+  return 1;
+}
+
+EMITTER int type_b_touch_move(internal_state_t* state, int caps, int contact, int x, int y, int pressure)
+{
+  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  {
+    return 0;
+  }
+
+  contact_t* slot = &state->contacts[contact];
+
+  select_slot(state, contact);
+
+  if ((caps & CAP_TOUCH_MAJOR))
+    WRITE_SLOT_EVENT(state, ABS_MT_TOUCH_MAJOR, &slot->sent_touch_major,
+      0x00000006);
+
+  if ((caps & CAP_WIDTH_MAJOR))
+    WRITE_SLOT_EVENT(state, ABS_MT_WIDTH_MAJOR, &slot->sent_width_major,
+      0x00000004);
+
+  if ((caps & CAP_PRESSURE))
+    WRITE_SLOT_EVENT(state, ABS_MT_PRESSURE, &slot->sent_pressure, pressure);
+
+  WRITE_SLOT_EVENT(state, ABS_MT_POSITION_X, &slot->sent_x, x);
+  WRITE_SLOT_EVENT(state, ABS_MT_POSITION_Y, &slot->sent_y, y);
+
+  return 1;
+}
+
+EMITTER int type_b_touch_up(internal_state_t* state, int caps, int contact)
+{
+  if (contact >= state->max_contacts || !state->contacts[contact].enabled)
+  {
+    return 0;
+  }
+
+  set_contact_enabled(state, contact, 0);
+  state->active_contacts -= 1;
+
+  select_slot(state, contact);
+  WRITE_EVENT(state, EV_ABS, ABS_MT_TRACKING_ID, -1);
+
+  // Send BTN_TOUCH only when no contacts remain.
+  if (state->active_contacts == 0 && (caps & CAP_BTN_TOUCH))
+    WRITE_EVENT(state, EV_KEY, BTN_TOUCH, 0);
+
+  return 1;
+}
+
+// Type A devices only send events on commit, while Type B devices send
+// them as the touches come in, so that's what gets specialized.
+#define DEFINE_TYPE_A_BACKEND(caps) \
+  static int type_a_commit_##caps(internal_state_t* state) \
+  { \
+    return type_a_commit(state, caps); \
+  }
+
+#define DEFINE_TYPE_B_BACKEND(caps) \
+  static int type_b_touch_down_##caps(internal_state_t* state, int contact, \
+    int x, int y, int pressure) \
+  { \
+    return type_b_touch_down(state, caps, contact, x, y, pressure); \
+  } \
+  static int type_b_touch_move_##caps(internal_state_t* state, int contact, \
+    int x, int y, int pressure) \
+  { \
+    return type_b_touch_move(state, caps, contact, x, y, pressure); \
+  } \
+  static int type_b_touch_up_##caps(internal_state_t* state, int contact) \
+  { \
+    return type_b_touch_up(state, caps, contact); \
+  }
+
+#define TYPE_A_BACKEND(caps) \
+  { \
+    type_a_touch_down, \
+    type_a_touch_move, \
+    type_a_touch_up, \
+    type_a_touch_panic_reset_all, \
+    type_a_commit_##caps, \
+  },
+
+#define TYPE_B_BACKEND(caps) \
+  { \
+    type_b_touch_down_##caps, \
+    type_b_touch_move_##caps, \
+    type_b_touch_up_##caps, \
+    type_b_touch_panic_reset_all, \
+    type_b_commit, \
+  },
+
+#define FOR_EACH_CAPS_16(X) \
+  X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+  X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)
+
+#define FOR_EACH_CAPS_32(X) \
+  FOR_EACH_CAPS_16(X) \
+  X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) \
+  X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)
+
+FOR_EACH_CAPS_32(DEFINE_TYPE_A_BACKEND)
+FOR_EACH_CAPS_16(DEFINE_TYPE_B_BACKEND)
+
+static const backend_t type_a_backends[32] = {
+  FOR_EACH_CAPS_32(TYPE_A_BACKEND)
+};
+
+static const backend_t type_b_backends[16] = {
+  FOR_EACH_CAPS_16(TYPE_B_BACKEND)
+};
+
+static void select_backend(internal_state_t* state)
+{
+  int caps = (state->has_key_btn_touch ? CAP_BTN_TOUCH : 0)
+    | (state->has_touch_major ? CAP_TOUCH_MAJOR : 0)
+    | (state->has_width_major ? CAP_WIDTH_MAJOR : 0)
+    | (state->has_pressure ? CAP_PRESSURE : 0);
+
+  if (state->has_mtslot)
+  {
+    state->backend = &type_b_backends[caps];
+  }
+  else
+  {
+    if (state->has_tracking_id)
+      caps |= CAP_TRACKING_ID;
+
+    state->backend = &type_a_backends[caps];
+  }
+}
+
+static int touch_down(internal_state_t* state, int contact, int x, int y, int pressure)
+{
+  return state->backend->touch_down(state, contact, x, y, pressure);
+}
+
+static int touch_move(internal_state_t* state, int contact, int x, int y, int pressure)
+{
+  return state->backend->touch_move(state, contact, x, y, pressure);
+}
+
+static int touch_up(internal_state_t* state, int contact)
+{
+  return state->backend->touch_up(state, contact);
+}
+
+static int touch_panic_reset_all(internal_state_t* state)
+{
+  return state->backend->touch_panic_reset_all(state);
+}
+
+static int commit(internal_state_t* state)
+{
+  if (g_stats_enabled)
+  {
+    long long now_ns = monotonic_ns();
+
+    if (g_stats.last_commit_ns != 0)
+      histogram_record(&g_stats.commit, now_ns - g_stats.last_commit_ns);
+
+    g_stats.last_commit_ns = now_ns;
+  }
+
+  return state->backend->commit(state);
+}
+
+static int start_server(char* sockname)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0)
+  {
+    perror("creating socket");
+    return fd;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(&addr.sun_path[1], sockname, strlen(sockname));
+
+  if (bind(fd, (struct sockaddr*) &addr,
+    sizeof(sa_family_t) + strlen(sockname) + 1) < 0)
+  {
+    perror("binding socket");
+    close(fd);
+    return -1;
+  }
+
+  listen(fd, SOMAXCONN);
+
+  return fd;
+}
+
+// Binary records are fixed-size and little-endian:
+//
+//   uint8_t type      same letters as the text protocol ('d', 'm', ...)
+//   uint8_t contact
+//   uint16_t reserved must be 0
+//   int32_t x         or the number of milliseconds for 'w'
+//   int32_t y
+//   int32_t pressure
+#define BINARY_RECORD_SIZE 16
+
+// Affine matrix entries are limited to this many device units, and
+// coordinates are clamped to half as many before a matrix is applied, so
+// that the 16.16 fixed point math can't overflow 64 bits.
+#define MAX_AFFINE_VALUE (1L << 23)
+#define MAX_AFFINE_COORDINATE (1L << 22)
+
+typedef struct
+{
+  char type;
+  long int contact;
+  long int x;
+  long int y;
+  long int pressure;
+  long int wait;
+  long int contact2;
+  long int x2;
+  long int y2;
+  long int duration;
+  long int steps;
+  long int rotation;
+  int64_t matrix[6];
+  long long tag;
+  long int rate;
+  long int interpolation;
+} command_t;
+
+static int32_t read_le32(const unsigned char* bytes)
+{
+  return (int32_t) ((uint32_t) bytes[0]
+    | ((uint32_t) bytes[1] << 8)
+    | ((uint32_t) bytes[2] << 16)
+    | ((uint32_t) bytes[3] << 24));
+}
+
+static void parse_text_command(char* buffer, command_t* command)
+{
+  char* cursor;
+  int i;
+
+  memset(command, 0, sizeof(*command));
+  command->type = buffer[0];
+
+  cursor = (char*) buffer;
+  cursor += 1;
+
+  switch (buffer[0])
+  {
+    case 'c': // COMMIT
+      command->tag = strtoll(cursor, &cursor, 10);
+      break;
+    case 'k': // ACK MODE
+    case 'e': // SELECT DEVICE
+    case 'q': // SHARED RING
+      command->x = strtol(cursor, &cursor, 10);
+      break;
+    case 'i': // INTERPOLATE
+      command->rate = strtol(cursor, &cursor, 10);
+      command->duration = strtol(cursor, &cursor, 10);
+      command->interpolation = strtol(cursor, &cursor, 10);
+      break;
+    case 'd': // TOUCH DOWN
+    case 'm': // TOUCH MOVE
+      command->contact = strtol(cursor, &cursor, 10);
+      command->x = strtol(cursor, &cursor, 10);
+      command->y = strtol(cursor, &cursor, 10);
+      command->pressure = strtol(cursor, &cursor, 10);
+      break;
+    case 'u': // TOUCH UP
+      command->contact = strtol(cursor, &cursor, 10);
+      break;
+    case 'w': // WAIT
+      command->wait = strtol(cursor, &cursor, 10);
+      break;
+    case 's': // SWIPE
+    case 'f': // FLING
+      command->contact = strtol(cursor, &cursor, 10);
+      command->x = strtol(cursor, &cursor, 10);
+      command->y = strtol(cursor, &cursor, 10);
+      command->x2 = strtol(cursor, &cursor, 10);
+      command->y2 = strtol(cursor, &cursor, 10);
+      command->pressure = strtol(cursor, &cursor, 10);
+      command->duration = strtol(cursor, &cursor, 10);
+      command->steps = strtol(cursor, &cursor, 10);
+      break;
+    case 'p': // PINCH
+      // The center is stored in x and y, and the distance between the two
+      // contacts goes from x2 to y2.
+      command->contact = strtol(cursor, &cursor, 10);
+      command->contact2 = strtol(cursor, &cursor, 10);
+      command->x = strtol(cursor, &cursor, 10);
+      command->y = strtol(cursor, &cursor, 10);
+      command->x2 = strtol(cursor, &cursor, 10);
+      command->y2 = strtol(cursor, &cursor, 10);
+      command->pressure = strtol(cursor, &cursor, 10);
+      command->duration = strtol(cursor, &cursor, 10);
+      command->steps = strtol(cursor, &cursor, 10);
+      break;
+    case 'l': // LONG PRESS
+      command->contact = strtol(cursor, &cursor, 10);
+      command->x = strtol(cursor, &cursor, 10);
+      command->y = strtol(cursor, &cursor, 10);
+      command->pressure = strtol(cursor, &cursor, 10);
+      command->duration = strtol(cursor, &cursor, 10);
+      break;
+    case 't': // SCREEN TRANSFORM
+      command->x = strtol(cursor, &cursor, 10);
+      command->y = strtol(cursor, &cursor, 10);
+      command->rotation = strtol(cursor, &cursor, 10);
+      break;
+    case 'a': // AFFINE TRANSFORM
+      // Converted to 16.16 fixed point once here, so that applying the
+      // matrix never needs floating point math.
+      // Out of range values are turned away by set_affine_transform().
+      for (i = 0; i < 6; ++i)
+      {
+        double value = strtod(cursor, &cursor) * 65536;
+
+        command->matrix[i] = fabs(value) <= MAX_AFFINE_VALUE * 65536.0
+          ? llround(value) : INT64_MAX;
+      }
+      break;
+  }
+}
+
+static void parse_binary_command(const unsigned char* record,
+  command_t* command)
+{
+  memset(command, 0, sizeof(*command));
+  command->type = record[0];
+  command->contact = record[1];
+
+  switch (command->type)
+  {
+    case 'd': // TOUCH DOWN
+    case 'm': // TOUCH MOVE
+      command->x = read_le32(record + 4);
+      command->y = read_le32(record + 8);
+      command->pressure = read_le32(record + 12);
+      break;
+    case 'k': // ACK MODE
+    case 'e': // SELECT DEVICE
+    case 'q': // SHARED RING
+      command->x = read_le32(record + 4);
+      break;
+    case 'w': // WAIT
+      command->wait = read_le32(record + 4);
+      break;
+    case 'c': // COMMIT
+      command->tag = (long long) ((uint32_t) read_le32(record + 4)
+        | ((uint64_t) (uint32_t) read_le32(record + 8) << 32));
+      break;
+  }
+}
+
+static void run_command(const command_t* command, internal_state_t* state)
+{
+  switch (command->type)
+  {
+    case 'c': // COMMIT
+      commit(state);
+      break;
+    case 'r': // RESET
+      touch_panic_reset_all(state);
+      break;
+    case 'd': // TOUCH DOWN
+      touch_down(state, command->contact, command->x, command->y,
+        command->pressure);
+      break;
+    case 'm': // TOUCH MOVE
+      touch_move(state, command->contact, command->x, command->y,
+        command->pressure);
+      break;
+    case 'u': // TOUCH UP
+      touch_up(state, command->contact);
+      break;
+    default:
+      break;
+  }
+}
+
+// Where the data of a single read() ends in the buffer, and when it was
+// read. Commands sitting in the buffer for a while still get the time of
+// the read that delivered them.
+typedef struct
+{
+  size_t end;
+  long long read_ns;
+} input_chunk_t;
+
+typedef struct
+{
+  int fd;
+  int socket;
+  int binary;
+  int discarding;
+  size_t start;
+  size_t end;
+  long long read_ns;
+  input_chunk_t chunks[MAX_INPUT_CHUNKS];
+  int num_chunks;
+  int passed_fds[2];
+  int num_passed_fds;
+  char data[INPUT_BUFFER_SIZE];
+} input_buffer_t;
+
+// Like read(), but also picks up file descriptors passed along with the
+// data, which is how clients hand over a shared ring.
+static ssize_t receive_input(input_buffer_t* input)
+{
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  ssize_t result;
+
+  iov.iov_base = input->data + input->end;
+  iov.iov_len = sizeof(input->data) - 1 - input->end;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if ((result = recvmsg(input->fd, &msg, MSG_CMSG_CLOEXEC)) < 0)
+  {
+    return result;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+      cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    size_t offset;
+
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    for (offset = 0; offset + sizeof(int) <= cmsg->cmsg_len - CMSG_LEN(0);
+        offset += sizeof(int))
+    {
+      int fd;
+
+      memcpy(&fd, CMSG_DATA(cmsg) + offset, sizeof(fd));
+
+      if (input->num_passed_fds < 2)
+        input->passed_fds[input->num_passed_fds++] = fd;
+      else
+        close(fd);
+    }
+  }
+
+  if (msg.msg_flags & MSG_CTRUNC)
+  {
+    fprintf(stderr, "Dropped file descriptors sent by client %d\n",
+      input->fd);
+  }
+
+  return result;
+}
+
+// Marks everything up to the given offset as used, and sets the read time
+// to that of the read that completed it.
+static void consume_input(input_buffer_t* input, size_t offset)
+{
+  int used = 0;
+
+  input->start = offset;
+
+  while (used < input->num_chunks && input->chunks[used].end < offset)
+  {
+    used += 1;
+  }
+
+  if (used < input->num_chunks)
+  {
+    input->read_ns = input->chunks[used].read_ns;
+
+    if (input->chunks[used].end == offset)
+      used += 1;
+  }
+
+  input->num_chunks -= used;
+  memmove(input->chunks, input->chunks + used,
+    input->num_chunks * sizeof(input_chunk_t));
+}
+
+// Reads as much as is available into the buffer. Any partial command left
+// over from the previous read is moved to the front first, so that commands
+// can always be parsed in place. Returns the result of read().
+static ssize_t fill_input(input_buffer_t* input)
+{
+  ssize_t result;
+  int i;
+
+  if (input->start > 0)
+  {
+    memmove(input->data, input->data + input->start,
+      input->end - input->start);
+
+    for (i = 0; i < input->num_chunks; ++i)
+    {
+      input->chunks[i].end -= input->start;
+    }
+
+    input->end -= input->start;
+    input->start = 0;
+  }
+
+  if (input->end == sizeof(input->data) - 1)
+  {
+    // A single line filled the whole buffer. It cannot be a valid command,
+    // so drop it, along with the rest of it that's still to come, rather
+    // than stalling forever.
+    fprintf(stderr, "Discarding overlong input line\n");
+    input->end = 0;
+    input->num_chunks = 0;
+    input->discarding = 1;
+  }
+
+  // Always leave room for a terminating NUL at EOF.
+  do
+  {
+    if (input->socket)
+      result = receive_input(input);
+    else
+      result = read(input->fd, input->data + input->end,
+        sizeof(input->data) - 1 - input->end);
+  }
+  while (result < 0 && errno == EINTR);
+
+  if (result > 0)
+  {
+    input->end += result;
+
+    // Should a slow client leave lots of small reads in the buffer, the
+    // newest ones share the time of the oldest of them.
+    if (input->num_chunks == MAX_INPUT_CHUNKS)
+    {
+      input->chunks[input->num_chunks - 1].end = input->end;
+    }
+    else
+    {
+      input->chunks[input->num_chunks].end = input->end;
+      input->chunks[input->num_chunks].read_ns = monotonic_ns();
+      input->num_chunks += 1;
+    }
+  }
+
+  if (input->discarding)
+  {
+    char* newline = memchr(input->data, '\n', input->end);
+
+    if (newline != NULL)
+    {
+      consume_input(input, newline - input->data + 1);
+      input->discarding = 0;
+    }
+    else
+    {
+      input->end = 0;
+      input->num_chunks = 0;
+    }
+  }
+
+  return result;
+}
+
+// Decodes the next complete command from the buffer, if any. Text lines are
+// terminated in place and parsed directly from the buffer. Returns 1 if a
+// command was decoded, or 0 if more input is needed. When at_eof is set,
+// an unterminated final line is accepted as well.
+static int next_command(input_buffer_t* input, command_t* command, int at_eof)
+{
+  while (input->start < input->end)
+  {
+    char* line = input->data + input->start;
+    size_t available = input->end - input->start;
+
+    if (input->binary)
+    {
+      if (available < BINARY_RECORD_SIZE)
+      {
+        return 0;
+      }
+
+      long long start_ns = g_stats_enabled ? monotonic_ns() : 0;
+
+      parse_binary_command((unsigned char*) line, command);
+      consume_input(input, input->start + BINARY_RECORD_SIZE);
+
+      if (g_stats_enabled)
+        histogram_record(&g_stats.parse, monotonic_ns() - start_ns);
+
+      return 1;
+    }
+
+    char* newline = memchr(line, '\n', available);
+
+    if (newline == NULL)
+    {
+      if (!at_eof)
+      {
+        return 0;
+      }
+
+      newline = line + available;
+    }
+
+    *newline = '\0';
+    consume_input(input, newline < input->data + input->end
+      ? newline - input->data + 1 : input->end);
+
+    line[strcspn(line, "\r")] = '\0';
+
+    if (line[0] == 'b')
+    {
+      if (g_verbose)
+        fprintf(stderr, "Switching to binary protocol\n");
+
+      input->binary = 1;
+      continue;
+    }
+
+    long long start_ns = g_stats_enabled ? monotonic_ns() : 0;
+
+    parse_text_command(line, command);
+
+    if (g_stats_enabled)
+      histogram_record(&g_stats.parse, monotonic_ns() - start_ns);
+
+    return 1;
+  }
+
+  return 0;
+}
+
+// Waits are scheduled against absolute CLOCK_MONOTONIC deadlines instead
+// of sleeping, so that input keeps flowing in while we wait and the time
+// spent running commands between waits does not add up. Consecutive waits
+// extend the previous deadline; the schedule is re-anchored to the current
+// time whenever we run out of commands and have to wait for the client.
+typedef struct
+{
+  int timer_fd;
+  int anchored;
+  int waiting;
+  struct timespec deadline;
+} scheduler_t;
+
+static void timespec_add_ms(struct timespec* ts, long int ms)
+{
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000;
+
+  if (ts->tv_nsec >= 1000000000)
+  {
+    ts->tv_sec += 1;
+    ts->tv_nsec -= 1000000000;
+  }
+  else if (ts->tv_nsec < 0)
+  {
+    ts->tv_sec -= 1;
+    ts->tv_nsec += 1000000000;
+  }
+}
+
+static long long timespec_diff_us(const struct timespec* a,
+  const struct timespec* b)
+{
+  return (a->tv_sec - b->tv_sec) * 1000000LL
+    + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+// Starts the schedule from the current time unless it already has a base.
+static void anchor_schedule(scheduler_t* scheduler)
+{
+  if (!scheduler->anchored)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &scheduler->deadline);
+    scheduler->anchored = 1;
+  }
+}
+
+// Returns 1 if the caller must stop running commands until the timer fires.
+static int schedule_at(scheduler_t* scheduler, const struct timespec* deadline)
+{
+  struct timespec now;
+  struct itimerspec timer = {{0, 0}, {0, 0}};
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  scheduler->deadline = *deadline;
+  scheduler->anchored = 1;
+
+  if (timespec_diff_us(&scheduler->deadline, &now) <= 0)
+  {
+    return 0;
+  }
+
+  timer.it_value = scheduler->deadline;
+
+  if (timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0)
+  {
+    perror("timerfd_settime");
+    return 0;
+  }
+
+  scheduler->waiting = 1;
+
+  return 1;
+}
+
+static int schedule_wait(scheduler_t* scheduler, long int ms)
+{
+  struct timespec deadline;
+
+  anchor_schedule(scheduler);
+
+  deadline = scheduler->deadline;
+  timespec_add_ms(&deadline, ms);
+
+  if (g_verbose)
+    fprintf(stderr, "Waiting %ld ms\n", ms);
+
+  return schedule_at(scheduler, &deadline);
+}
+
+static void finish_wait(scheduler_t* scheduler)
+{
+  uint64_t expirations;
+
+  if (read(scheduler->timer_fd, &expirations, sizeof(expirations)) < 0
+      && errno != EAGAIN)
+  {
+    perror("reading timer");
+  }
+
+  if (g_verbose)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "Wait finished %lld us after deadline\n",
+      timespec_diff_us(&now, &scheduler->deadline));
+  }
+
+  scheduler->waiting = 0;
+}
+
+#define WATCH_SERVER 0
+#define WATCH_INPUT 1
+#define WATCH_TIMER 2
+#define WATCH_WRITER 3
+#define WATCH_RESAMPLE 4
+#define WATCH_RING 5
+
+struct client;
+
+typedef struct
+{
+  int kind;
+  struct client* client;
+} watch_t;
+
+// A gesture is played out in phases: phase 0 puts the contacts down at
+// their starting points, phases 1 to steps move them along the path and
+// the final phase lifts them again, each one followed by a commit. The
+// phases are spread evenly over the duration, using integer math only.
+typedef struct
+{
+  int active;
+  char type;
+  int num_contacts;
+  long int contacts[2];
+  long int from_x[2];
+  long int from_y[2];
+  long int to_x[2];
+  long int to_y[2];
+  long int pressure;
+  long int duration;
+  long int steps;
+  long int phase;
+  struct timespec start;
+} gesture_t;
+
+// Maps client coordinates to touch device coordinates with an affine
+// matrix in 16.16 fixed point:
+//
+//   x' = m[0] * x + m[1] * y + m[2]
+//   y' = m[3] * x + m[4] * y + m[5]
+typedef struct
+{
+  int enabled;
+  int64_t m[6];
+} transform_t;
+
+// Positions a client has sent for a single device contact, for the
+// resampler to interpolate between.
+typedef struct
+{
+  int count;
+  int lifting;
+  long long up_ns;
+  long int sent_x;
+  long int sent_y;
+  long int sent_pressure;
+  long long t[RESAMPLE_HISTORY];
+  long int x[RESAMPLE_HISTORY];
+  long int y[RESAMPLE_HISTORY];
+  long int pressure[RESAMPLE_HISTORY];
+} track_t;
+
+#define INTERPOLATE_LINEAR 0
+#define INTERPOLATE_CATMULL_ROM 1
+
+// Turns sparse moves into a steady stream. Moves are only recorded as they
+// come in, and a periodic timer plays them back a fixed delay later,
+// interpolating between them at the output rate. The delay is what lets
+// us look ahead to the next position.
+typedef struct
+{
+  int enabled;
+  int interpolation;
+  int armed;
+  int timer_fd;
+  long long period_ns;
+  long long delay_ns;
+  unsigned long deferred_seq[RESAMPLE_HISTORY];
+  long long deferred_ns[RESAMPLE_HISTORY];
+  int num_deferred;
+  unsigned long signalled_seq;
+  watch_t watch;
+} resampler_t;
+
+// Every connection gets its own contact namespace. Contact numbers used by
+// the client are mapped to free device contacts on touch down, preferring
+// the same number when available, so that a single client sees exactly the
+// contacts it asked for. Contacts are released when the client goes away.
+//
+// With several devices, the client has a surface for each of them, and
+// commands go to whichever one it last selected with 'e'.
+typedef struct
+{
+  internal_state_t* state;
+  transform_t transform;
+  int* contacts;
+  command_t* stashed_moves;
+  int num_stashed;
+  track_t* tracks;
+  int dirty;
+} surface_t;
+
+// A ring of binary records in memory shared with a local client, so that
+// commands can be handed over without a syscall or a copy for each write.
+// The client only ever writes the tail and the records, and we only write
+// the head and the waiting flag, each on a cache line of its own. When
+// we're about to go to sleep, we set the waiting flag, and the client
+// rings the doorbell after adding records while it's set.
+#define RING_TAIL_OFFSET 0
+#define RING_HEAD_OFFSET 64
+#define RING_WAITING_OFFSET 128
+#define RING_HEADER_SIZE 192
+
+typedef struct
+{
+  unsigned char* memory;
+  size_t size;
+  uint32_t* tail;
+  uint32_t* head;
+  uint32_t* waiting;
+  unsigned char* records;
+  uint32_t capacity;
+  uint32_t next;
+  long long read_ns;
+  int doorbell_fd;
+  int epoll_fd;
+  watch_t watch;
+} shared_ring_t;
+
+typedef struct client
+{
+  int fd;
+  int at_eof;
+  int pollable;
+  int events;
+  int pending;
+  watch_t input_watch;
+  watch_t timer_watch;
+  scheduler_t scheduler;
+  gesture_t gesture;
+  resampler_t resampler;
+  int ack;
+  unsigned long commits;
+  unsigned long completed;
+  unsigned long written;
+  unsigned long acked;
+  int frame_moves_only;
+  surface_t* surfaces;
+  int num_surfaces;
+  surface_t* surface;
+  shared_ring_t* ring;
+  struct client* next;
+  input_buffer_t input;
+  output_buffer_t output;
+} client_t;
+
+typedef struct
+{
+  int epoll_fd;
+  int server_fd;
+  watch_t server_watch;
+  watch_t writer_watch;
+  internal_state_t* devices;
+  int num_devices;
+  client_t* clients;
+} server_t;
+
+// With -w, the touch device belongs to a writer thread of its own, so that
+// slow clients can't hold up the events of others. The main thread keeps
+// parsing, mapping and scheduling, and hands the resulting device commands
+// over through a single-producer, single-consumer ring. Commits that the
+// client wants to hear about come back the same way through a second ring.
+// Apart from their immutable limits, the devices must not be touched by
+// the main thread while the writer is running.
+typedef struct
+{
+  command_t command;
+  internal_state_t* state;
+  client_t* client;
+  unsigned long seq;
+  long long read_ns;
+} queued_command_t;
+
+typedef struct
+{
+  client_t* client;
+  unsigned long seq;
+  int resampled;
+  long long tag;
+  long long read_ns;
+  long long write_ns;
+} completion_t;
+
+typedef struct
+{
+  pthread_t thread;
+  int cpu;
+  int priority;
+  int wake_fd;
+  int completion_fd;
+  int progress_fd;
+  int sleeping;
+  int waiting;
+  int stopping;
+  unsigned long head;
+  unsigned long tail;
+  unsigned long completion_head;
+  unsigned long completion_tail;
+  unsigned long completions_dropped;
+  queued_command_t commands[WRITER_QUEUE_SIZE];
+  completion_t completions[WRITER_QUEUE_SIZE];
+} writer_t;
+
+static writer_t* g_writer = NULL;
+
+static void wake_fd(int fd)
+{
+  uint64_t one = 1;
+
+  while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static void drain_fd(int fd)
+{
+  uint64_t count;
+
+  while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR);
+}
+
+static void setup_writer_thread(writer_t* writer)
+{
+  if (writer->cpu >= 0)
+  {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(writer->cpu, &cpus);
+
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+      perror("sched_setaffinity");
+  }
+
+  if (writer->priority > 0)
+  {
+    struct sched_param param = {0};
+    int result;
+
+    param.sched_priority = writer->priority;
+
+    if ((result = pthread_setschedparam(pthread_self(), SCHED_FIFO,
+        &param)) != 0)
+      fprintf(stderr, "Unable to use SCHED_FIFO for the writer: %s\n",
+        strerror(result));
+  }
+}
+
+static void* writer_main(void* arg)
+{
+  writer_t* writer = arg;
+  unsigned long head = writer->head;
+  unsigned long completion_tail = writer->completion_tail;
+  int completed = 0;
+
+  setup_writer_thread(writer);
+
+  while (1)
+  {
+    if (head == __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE))
+    {
+      if (completed)
+      {
+        wake_fd(writer->completion_fd);
+        completed = 0;
+      }
+
+      // Announce that we're about to sleep, then look again, so that the
+      // main thread can't slip something in without waking us up.
+      __atomic_store_n(&writer->sleeping, 1, __ATOMIC_SEQ_CST);
+
+      if (head == __atomic_load_n(&writer->tail, __ATOMIC_SEQ_CST))
+      {
+        if (__atomic_load_n(&writer->stopping, __ATOMIC_ACQUIRE))
+          break;
+
+        drain_fd(writer->wake_fd);
+      }
+
+      __atomic_store_n(&writer->sleeping, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    queued_command_t* queued = &writer->commands[head % WRITER_QUEUE_SIZE];
+
+    run_command(&queued->command, queued->state);
+
+    if (queued->client != NULL)
+    {
+      if (completion_tail - __atomic_load_n(&writer->completion_head,
+          __ATOMIC_ACQUIRE) < WRITER_QUEUE_SIZE)
+      {
+        completion_t* completion =
+          &writer->completions[completion_tail % WRITER_QUEUE_SIZE];
+
+        completion->client = queued->client;
+        completion->seq = queued->seq;
+        completion->resampled = queued->command.type != 'c';
+        completion->tag = queued->command.tag;
+        completion->read_ns = queued->read_ns;
+        completion->write_ns = monotonic_ns();
+
+        __atomic_store_n(&writer->completion_tail, ++completion_tail,
+          __ATOMIC_RELEASE);
+        completed = 1;
+      }
+      else
+      {
+        // Never block on the main thread, it may be waiting for us.
+        writer->completions_dropped += 1;
+      }
+    }
+
+    __atomic_store_n(&writer->head, ++head, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&writer->waiting, __ATOMIC_SEQ_CST))
+      wake_fd(writer->progress_fd);
+  }
+
+  return NULL;
+}
+
+static int start_writer(int cpu, int priority)
+{
+  writer_t* writer = calloc(1, sizeof(writer_t));
+  int result;
+
+  if (writer == NULL)
+  {
+    perror("allocating writer");
+    return -1;
+  }
+
+  writer->cpu = cpu;
+  writer->priority = priority;
+  writer->wake_fd = eventfd(0, 0);
+  writer->completion_fd = eventfd(0, EFD_NONBLOCK);
+  writer->progress_fd = eventfd(0, 0);
+
+  if (writer->wake_fd < 0 || writer->completion_fd < 0
+      || writer->progress_fd < 0)
+  {
+    perror("eventfd");
+    return -1;
+  }
+
+  if ((result = pthread_create(&writer->thread, NULL, writer_main,
+      writer)) != 0)
+  {
+    fprintf(stderr, "Unable to start writer thread: %s\n", strerror(result));
+    return -1;
+  }
+
+  g_writer = writer;
+
+  return 0;
+}
+
+// Sleeps until the writer has moved on from the given head, the same way
+// the writer sleeps until there's something to do. The caller has to look
+// again, as a wakeup may be left over from an earlier wait.
+static void wait_for_writer(writer_t* writer, unsigned long head)
+{
+  __atomic_store_n(&writer->waiting, 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&writer->head, __ATOMIC_SEQ_CST) == head)
+    drain_fd(writer->progress_fd);
+
+  __atomic_store_n(&writer->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+// Hands a device command over to the writer. If the ring is full, we have
+// no choice but to wait for the writer to catch up.
+static void queue_command(writer_t* writer, const command_t* command,
+  internal_state_t* state, client_t* client, unsigned long seq,
+  long long read_ns)
+{
+  unsigned long tail = writer->tail;
+  unsigned long head;
+  queued_command_t* queued;
+
+  while (tail - (head = __atomic_load_n(&writer->head, __ATOMIC_ACQUIRE))
+      == WRITER_QUEUE_SIZE)
+  {
+    wake_fd(writer->wake_fd);
+    wait_for_writer(writer, head);
+  }
+
+  queued = &writer->commands[tail % WRITER_QUEUE_SIZE];
+  queued->command = *command;
+  queued->state = state;
+  queued->client = client;
+  queued->seq = seq;
+  queued->read_ns = read_ns;
+
+  __atomic_store_n(&writer->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  // Nothing reaches the device before a commit, so there's no point in
+  // waking the writer up any sooner, unless someone's waiting to hear back.
+  if ((command->type == 'c' || command->type == 'r' || client != NULL)
+      && __atomic_load_n(&writer->sleeping, __ATOMIC_SEQ_CST))
+  {
+    wake_fd(writer->wake_fd);
+  }
+}
+
+// Waits until the writer has run everything queued so far.
+static void sync_writer(writer_t* writer)
+{
+  unsigned long head;
+
+  wake_fd(writer->wake_fd);
+
+  while ((head = __atomic_load_n(&writer->head, __ATOMIC_ACQUIRE))
+      != writer->tail)
+  {
+    wait_for_writer(writer, head);
+  }
+}
+
+static void stop_writer(writer_t* writer)
+{
+  sync_writer(writer);
+  __atomic_store_n(&writer->stopping, 1, __ATOMIC_RELEASE);
+  wake_fd(writer->wake_fd);
+  pthread_join(writer->thread, NULL);
+
+  if (writer->completions_dropped > 0)
+    fprintf(stderr, "Dropped %lu commit notifications\n",
+      writer->completions_dropped);
+
+  close(writer->wake_fd);
+  close(writer->completion_fd);
+  close(writer->progress_fd);
+  g_writer = NULL;
+  free(writer);
+}
+
+static void send_banner(output_buffer_t* output, internal_state_t* devices,
+  int num_devices)
+{
+  internal_state_t* state = &devices[0];
+  int i;
+
+  // Tell version
+  output_printf(output, "v %d\n", VERSION);
+
+  // Tell limits
+  output_printf(output, "^ %d %d %d %d\n",
+          state->max_contacts, state->max_x, state->max_y, state->max_pressure);
+
+  // Tell the limits of every device, if there's more than one
+  for (i = 0; num_devices > 1 && i < num_devices; ++i)
+  {
+    output_printf(output, "e %d %d %d %d %d\n", i, devices[i].max_contacts,
+      devices[i].max_x, devices[i].max_y, devices[i].max_pressure);
+  }
+
+  // Tell pid
+  output_printf(output, "$ %d\n", getpid());
+
+  // Tell binary record size
+  output_printf(output, "b %d\n", BINARY_RECORD_SIZE);
+}
+
+static int map_contact(surface_t* surface, long int contact, int allocate)
+{
+  internal_state_t* state = surface->state;
+  int slot;
+
+  if (contact < 0 || contact >= state->max_contacts)
+  {
+    return -1;
+  }
+
+  if (surface->contacts[contact] >= 0 || !allocate)
+  {
+    return surface->contacts[contact];
+  }
+
+  // Contacts stay owned until their up has been committed, as Type A
+  // devices keep them enabled until then. Ownership is only touched by the
+  // main thread, so this is safe even with a writer thread.
+  if (!state->contacts[contact].owned)
+  {
+    slot = contact;
+  }
+  else
+  {
+    for (slot = 0; slot < state->max_contacts; ++slot)
+    {
+      if (!state->contacts[slot].owned)
+        break;
+    }
+
+    if (slot == state->max_contacts)
+    {
+      if (g_verbose)
+        fprintf(stderr, "No free contact for client contact %ld\n", contact);
+
+      return -1;
+    }
+  }
+
+  state->contacts[slot].owned = 1;
+  surface->contacts[contact] = slot;
+
+  return slot;
+}
+
+// Lifted contacts are marked with 2, and only become free again with the
+// next commit or reset of the device.
+static void release_slot(internal_state_t* state, int slot)
+{
+  state->contacts[slot].owned = 2;
+  state->lifted_contacts += 1;
+}
+
+static void reclaim_lifted_slots(internal_state_t* state)
+{
+  int slot;
+
+  for (slot = 0; slot < state->max_contacts; ++slot)
+  {
+    if (state->contacts[slot].owned == 2)
+      state->contacts[slot].owned = 0;
+  }
+
+  state->lifted_contacts = 0;
+}
+
+static void unmap_contact(surface_t* surface, long int contact)
+{
+  release_slot(surface->state, surface->contacts[contact]);
+  surface->contacts[contact] = -1;
+}
+
+// Sets up a transform from screen coordinates, as seen in the given display
+// rotation (0, 90, 180 or 270 degrees, like Android's Display.getRotation()
+// times 90), to touch coordinates. A zero width or height removes the
+// transform.
+static void set_screen_transform(transform_t* transform,
+  internal_state_t* state, long int width, long int height, long int rotation)
+{
+  long int natural_width = width;
+  long int natural_height = height;
+  int64_t sx;
+  int64_t sy;
+
+  if (width <= 1 || height <= 1)
+  {
+    transform->enabled = 0;
+    return;
+  }
+
+  if (rotation == 90 || rotation == 270)
+  {
+    natural_width = height;
+    natural_height = width;
+  }
+
+  sx = ((int64_t) state->max_x << 16) / (natural_width - 1);
+  sy = ((int64_t) state->max_y << 16) / (natural_height - 1);
+
+  memset(transform->m, 0, sizeof(transform->m));
+
+  switch (rotation)
+  {
+    case 90:
+      // x = natural_width - 1 - y', y = x'
+      transform->m[1] = -sx;
+      transform->m[2] = sx * (natural_width - 1);
+      transform->m[3] = sy;
+      break;
+    case 180:
+      transform->m[0] = -sx;
+      transform->m[2] = sx * (natural_width - 1);
+      transform->m[4] = -sy;
+      transform->m[5] = sy * (natural_height - 1);
+      break;
+    case 270:
+      // x = y', y = natural_height - 1 - x'
+      transform->m[1] = sx;
+      transform->m[3] = -sy;
+      transform->m[5] = sy * (natural_height - 1);
+      break;
+    default:
+      transform->m[0] = sx;
+      transform->m[4] = sy;
+      break;
+  }
+
+  transform->enabled = 1;
+}
+
+// Returns -1 and leaves the transform alone if the matrix is out of range.
+static int set_affine_transform(transform_t* transform,
+  const int64_t* matrix)
+{
+  int i;
+
+  for (i = 0; i < 6; ++i)
+  {
+    if (matrix[i] < -(MAX_AFFINE_VALUE << 16)
+        || matrix[i] > (MAX_AFFINE_VALUE << 16))
+    {
+      if (g_verbose)
+        fprintf(stderr, "Affine matrix is out of range\n");
+
+      return -1;
+    }
+  }
+
+  for (i = 0; i < 6; ++i)
+  {
+    transform->m[i] = matrix[i];
+  }
+
+  // The identity matrix is the same as no transform at all.
+  transform->enabled = !(matrix[0] == 65536 && matrix[1] == 0
+    && matrix[2] == 0 && matrix[3] == 0 && matrix[4] == 65536
+    && matrix[5] == 0);
+
+  return 0;
+}
+
+static long int clamp(long int value, long int min, long int max)
+{
+  return value < min ? min : (value > max ? max : value);
+}
+
+static void apply_transform(const transform_t* transform,
+  internal_state_t* state, command_t* command)
+{
+  const int64_t* m = transform->m;
+  int64_t x = clamp(command->x, -MAX_AFFINE_COORDINATE, MAX_AFFINE_COORDINATE);
+  int64_t y = clamp(command->y, -MAX_AFFINE_COORDINATE, MAX_AFFINE_COORDINATE);
+
+  command->x = clamp((m[0] * x + m[1] * y + m[2] + 0x8000) >> 16,
+    0, state->max_x);
+  command->y = clamp((m[3] * x + m[4] * y + m[5] + 0x8000) >> 16,
+    0, state->max_y);
+}
+
+// Runs a device command right away, or queues it for the writer thread.
+// Commits are tracked all the way to the device when the client has asked
+// to hear about them.
+static void submit_command(client_t* client, const command_t* command,
+  internal_state_t* state)
+{
+  if (g_writer == NULL)
+  {
+    run_command(command, state);
+  }
+  else if (command->type == 'c' && client != NULL
+      && (command->tag != 0 || client->ack))
+  {
+    queue_command(g_writer, command, state, client, client->commits,
+      client->input.read_ns);
+  }
+  else
+  {
+    queue_command(g_writer, command, state, NULL, 0, 0);
+  }
+
+  if ((command->type == 'c' || command->type == 'r')
+      && state->lifted_contacts > 0)
+    reclaim_lifted_slots(state);
+}
+
+// When coalescing, moves are held back per device contact until something
+// other than a move comes along, so that a later move of the same contact
+// simply replaces an earlier one.
+static void stash_move(surface_t* surface, const command_t* command)
+{
+  command_t* stashed = &surface->stashed_moves[command->contact];
+
+  if (stashed->type != 'm')
+    surface->num_stashed += 1;
+
+  *stashed = *command;
+}
+
+static void run_stashed_moves(client_t* client, surface_t* surface)
+{
+  int slot;
+
+  for (slot = 0; slot < surface->state->max_contacts
+      && surface->num_stashed > 0; ++slot)
+  {
+    if (surface->stashed_moves[slot].type == 'm')
+    {
+      submit_command(client, &surface->stashed_moves[slot], surface->state);
+      surface->stashed_moves[slot].type = 0;
+      surface->num_stashed -= 1;
+    }
+  }
+}
+
+// Lifts every contact the client holds on the device, leaving those of
+// other connections alone. Returns 1 if there was anything to lift.
+static int lift_contacts(client_t* client, surface_t* surface)
+{
+  command_t command;
+  int contact;
+  int lifted = 0;
+
+  if (surface->num_stashed > 0)
+    run_stashed_moves(client, surface);
+
+  memset(&command, 0, sizeof(command));
+  command.type = 'u';
+
+  for (contact = 0; contact < surface->state->max_contacts; ++contact)
+  {
+    if (surface->contacts[contact] >= 0)
+    {
+      command.contact = surface->contacts[contact];
+      submit_command(NULL, &command, surface->state);
+      unmap_contact(surface, contact);
+      lifted = 1;
+    }
+  }
+
+  return lifted;
+}
+
+// Tells whether the whole of the next frame is already buffered, and
+// consists of nothing but moves.
+static int next_frame_is_moves(const input_buffer_t* input)
+{
+  size_t offset = input->start;
+  const char* newline;
+  char type;
+
+  while (offset < input->end)
+  {
+    const char* line = input->data + offset;
+    size_t available = input->end - offset;
+
+    if (input->binary)
+    {
+      if (available < BINARY_RECORD_SIZE)
+        return 0;
+
+      offset += BINARY_RECORD_SIZE;
+    }
+    else
+    {
+      if ((newline = memchr(line, '\n', available)) == NULL)
+        return 0;
+
+      offset = newline - input->data + 1;
+    }
+
+    type = line[0];
+
+    if (type == 'c')
+      return 1;
+
+    if (type != 'm')
+      return 0;
+  }
+
+  return 0;
+}
+
+static void detach_ring(client_t* client)
+{
+  shared_ring_t* ring = client->ring;
+
+  if (ring == NULL)
+    return;
+
+  // The client shares the doorbell, so closing our descriptor alone would
+  // leave it registered.
+  if (ring->epoll_fd >= 0)
+    epoll_ctl(ring->epoll_fd, EPOLL_CTL_DEL, ring->doorbell_fd, NULL);
+
+  close(ring->doorbell_fd);
+  munmap(ring->memory, ring->size);
+  free(ring);
+
+  client->ring = NULL;
+}
+
+// Eventfds can only be told apart from other anonymous descriptors by the
+// name of their inode.
+static int is_eventfd(int fd)
+{
+  static const char expected[] = "anon_inode:[eventfd]";
+  char path[64];
+  char target[sizeof(expected)];
+  ssize_t length;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  length = readlink(path, target, sizeof(target));
+
+  return length == sizeof(expected) - 1
+    && memcmp(target, expected, length) == 0;
+}
+
+// Maps the memory passed along with 'q', and takes the doorbell that came
+// with it. Anything that doesn't look right is dropped.
+static void attach_ring(client_t* client, long int records)
+{
+  input_buffer_t* input = &client->input;
+  shared_ring_t* ring = NULL;
+  struct stat info;
+  void* memory;
+  int memory_fd;
+  int doorbell_fd;
+  int seals;
+
+  if (input->num_passed_fds < 2)
+  {
+    fprintf(stderr, "Shared ring needs a memory and a doorbell descriptor\n");
+    goto fail;
+  }
+
+  memory_fd = input->passed_fds[0];
+  doorbell_fd = input->passed_fds[1];
+
+  if (records <= 0 || records > (1L << 24) || (records & (records - 1)) != 0)
+  {
+    fprintf(stderr, "Shared ring size %ld is not a power of two\n", records);
+    goto fail;
+  }
+
+  if (fstat(memory_fd, &info) != 0
+      || info.st_size < RING_HEADER_SIZE + records * BINARY_RECORD_SIZE)
+  {
+    fprintf(stderr, "Shared ring memory is too small for %ld records\n",
+      records);
+    goto fail;
+  }
+
+  // The doorbell is read from the event loop, so anything that could block
+  // there would hold up every connection. The flag is shared with the
+  // client, which only ever writes to it.
+  if (!is_eventfd(doorbell_fd)
+      || fcntl(doorbell_fd, F_SETFL,
+        fcntl(doorbell_fd, F_GETFL) | O_NONBLOCK) < 0)
+  {
+    fprintf(stderr, "Shared ring doorbell must be an eventfd\n");
+    goto fail;
+  }
+
+  // Memory that can shrink underneath us would crash us with SIGBUS.
+  seals = fcntl(memory_fd, F_GET_SEALS);
+
+  if (seals < 0 || !(seals & F_SEAL_SHRINK))
+  {
+    fprintf(stderr, "Shared ring memory must be sealed with F_SEAL_SHRINK\n");
+    goto fail;
+  }
+
+  if ((ring = calloc(1, sizeof(shared_ring_t))) == NULL)
+  {
+    perror("allocating shared ring");
+    goto fail;
+  }
+
+  ring->size = RING_HEADER_SIZE + records * BINARY_RECORD_SIZE;
+  memory = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+    memory_fd, 0);
+
+  if (memory == MAP_FAILED)
+  {
+    perror("mmap");
+    goto fail;
+  }
+
+  detach_ring(client);
+  close(memory_fd);
+
+  ring->memory = memory;
+  ring->tail = (uint32_t*) (ring->memory + RING_TAIL_OFFSET);
+  ring->head = (uint32_t*) (ring->memory + RING_HEAD_OFFSET);
+  ring->waiting = (uint32_t*) (ring->memory + RING_WAITING_OFFSET);
+  ring->records = ring->memory + RING_HEADER_SIZE;
+  ring->capacity = records;
+  ring->next = __atomic_load_n(ring->head, __ATOMIC_ACQUIRE);
+  ring->doorbell_fd = doorbell_fd;
+  ring->epoll_fd = -1;
+  ring->watch.kind = WATCH_RING;
+  ring->watch.client = client;
+
+  client->ring = ring;
+  input->num_passed_fds = 0;
+
+  if (g_verbose)
+    fprintf(stderr, "Attached shared ring of %ld records to client %d\n",
+      records, client->fd);
+
+  return;
+
+fail:
+  free(ring);
+
+  while (input->num_passed_fds > 0)
+  {
+    close(input->passed_fds[--input->num_passed_fds]);
+  }
+}
+
+// Returns how many records are waiting in the ring. A client claiming more
+// than fits has broken the ring, which is then dropped.
+static uint32_t ring_backlog(client_t* client)
+{
+  shared_ring_t* ring = client->ring;
+  uint32_t backlog;
+
+  if (ring == NULL)
+    return 0;
+
+  backlog = __atomic_load_n(ring->tail, __ATOMIC_ACQUIRE) - ring->next;
+
+  if (backlog > ring->capacity)
+  {
+    fprintf(stderr, "Dropping corrupt shared ring of client %d\n",
+      client->fd);
+    detach_ring(client);
+    return 0;
+  }
+
+  return backlog;
+}
+
+static const unsigned char* ring_record(const shared_ring_t* ring,
+  uint32_t index)
+{
+  return ring->records + (index & (ring->capacity - 1)) * BINARY_RECORD_SIZE;
+}
+
+// Decodes the next record straight from shared memory. The head is only
+// published at the end of the turn.
+static int next_ring_command(client_t* client, command_t* command)
+{
+  shared_ring_t* ring = client->ring;
+
+  if (ring_backlog(client) == 0)
+    return 0;
+
+  long long start_ns = g_stats_enabled ? monotonic_ns() : 0;
+
+  parse_binary_command(ring_record(ring, ring->next), command);
+  ring->next += 1;
+  client->input.read_ns = ring->read_ns;
+
+  if (g_stats_enabled)
+    histogram_record(&g_stats.parse, monotonic_ns() - start_ns);
+
+  return 1;
+}
+
+// Same as next_frame_is_moves(), for the ring.
+static int ring_frame_is_moves(client_t* client)
+{
+  uint32_t backlog = ring_backlog(client);
+  uint32_t i;
+
+  for (i = 0; i < backlog; ++i)
+  {
+    char type = ring_record(client->ring, client->ring->next + i)[0];
+
+    if (type == 'c')
+      return 1;
+
+    if (type != 'm')
+      return 0;
+  }
+
+  return 0;
+}
+
+// Lets the client reuse what we've read, and asks for the doorbell if
+// we're out of records. Looking again after setting the flag catches
+// records that were added just before the client could see it.
+static void park_ring(client_t* client)
+{
+  shared_ring_t* ring = client->ring;
+
+  __atomic_store_n(ring->head, ring->next, __ATOMIC_RELEASE);
+
+  if (client->pending || client->scheduler.waiting || client->gesture.active)
+    return;
+
+  __atomic_store_n(ring->waiting, 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(ring->tail, __ATOMIC_SEQ_CST) != ring->next)
+  {
+    __atomic_store_n(ring->waiting, 0, __ATOMIC_RELAXED);
+    client->pending = 1;
+  }
+}
+
+// Commands in the ring go first, then those on the socket.
+static int next_client_command(client_t* client, command_t* command)
+{
+  if (client->ring != NULL && next_ring_command(client, command))
+    return 1;
+
+  return next_command(&client->input, command, client->at_eof);
+}
+
+static int client_frame_is_moves(client_t* client)
+{
+  if (ring_backlog(client) > 0)
+    return ring_frame_is_moves(client);
+
+  return next_frame_is_moves(&client->input);
+}
+
+static void arm_resampler(resampler_t* resampler, int arm)
+{
+  struct itimerspec spec;
+
+  if (resampler->armed == arm)
+    return;
+
+  memset(&spec, 0, sizeof(spec));
+
+  if (arm)
+  {
+    spec.it_value.tv_sec = resampler->period_ns / 1000000000;
+    spec.it_value.tv_nsec = resampler->period_ns % 1000000000;
+    spec.it_interval = spec.it_value;
+  }
+
+  if (timerfd_settime(resampler->timer_fd, 0, &spec, NULL) < 0)
+    perror("timerfd_settime");
+
+  resampler->armed = arm;
+}
+
+static void drop_sample(track_t* track)
+{
+  track->count -= 1;
+  memmove(track->t, track->t + 1, track->count * sizeof(track->t[0]));
+  memmove(track->x, track->x + 1, track->count * sizeof(track->x[0]));
+  memmove(track->y, track->y + 1, track->count * sizeof(track->y[0]));
+  memmove(track->pressure, track->pressure + 1,
+    track->count * sizeof(track->pressure[0]));
+}
+
+static void add_sample(track_t* track, const command_t* command,
+  long long now_ns)
+{
+  int i = track->count;
+
+  if (i > 0 && track->t[i - 1] == now_ns)
+  {
+    // Only the latest of several moves read at once matters.
+    i -= 1;
+  }
+  else if (i == RESAMPLE_HISTORY)
+  {
+    drop_sample(track);
+    i -= 1;
+  }
+
+  track->t[i] = now_ns;
+  track->x[i] = command->x;
+  track->y[i] = command->y;
+  track->pressure[i] = command->pressure;
+  track->count = i + 1;
+}
+
+// Interpolates between samples i and i + 1, at fraction u of the way.
+static double interpolate(int interpolation, const long int* v, int i,
+  int count, double u)
+{
+  double p1 = v[i];
+  double p2 = v[i + 1];
+
+  if (interpolation == INTERPOLATE_CATMULL_ROM)
+  {
+    double p0 = i > 0 ? v[i - 1] : p1;
+    double p3 = i + 2 < count ? v[i + 2] : p2;
+
+    return 0.5 * (2 * p1 + (p2 - p0) * u
+      + (2 * p0 - 5 * p1 + 4 * p2 - p3) * u * u
+      + (3 * p1 - p0 - 3 * p2 + p3) * u * u * u);
+  }
+
+  return p1 + (p2 - p1) * u;
+}
+
+// Commits absorbed by the resampler only count as written once their moves
+// have been played back. Until then, they hold back the acknowledgement of
+// any commits after them, too.
+static void update_written(client_t* client)
+{
+  resampler_t* resampler = &client->resampler;
+  unsigned long written = client->completed;
+
+  if (resampler->num_deferred > 0 && resampler->deferred_seq[0] <= written)
+    written = resampler->deferred_seq[0] - 1;
+
+  if (written > client->written)
+    client->written = written;
+}
+
+// Should more commits pile up than we can keep track of, the latest one
+// stands in for the one before it, which is then acknowledged a bit late.
+static void defer_commit(client_t* client)
+{
+  resampler_t* resampler = &client->resampler;
+  int i = resampler->num_deferred;
+
+  if (i == RESAMPLE_HISTORY)
+    i -= 1;
+
+  resampler->deferred_seq[i] = client->commits;
+  resampler->deferred_ns[i] = client->input.read_ns;
+  resampler->num_deferred = i + 1;
+}
+
+static void finish_deferred(client_t* client, unsigned long seq)
+{
+  resampler_t* resampler = &client->resampler;
+  int done = 0;
+
+  while (done < resampler->num_deferred
+      && resampler->deferred_seq[done] <= seq)
+  {
+    done += 1;
+  }
+
+  resampler->num_deferred -= done;
+  memmove(resampler->deferred_seq, resampler->deferred_seq + done,
+    resampler->num_deferred * sizeof(resampler->deferred_seq[0]));
+  memmove(resampler->deferred_ns, resampler->deferred_ns + done,
+    resampler->num_deferred * sizeof(resampler->deferred_ns[0]));
+
+  if (seq > client->completed)
+    client->completed = seq;
+
+  update_written(client);
+}
+
+// Called once everything up to render_ns has been sent to the device.
+// With a writer thread, a marker follows the commands through the queue
+// and comes back once they have actually been written.
+static void finish_rendered(client_t* client, long long render_ns)
+{
+  resampler_t* resampler = &client->resampler;
+  unsigned long seq = 0;
+  int i;
+
+  for (i = 0; i < resampler->num_deferred; ++i)
+  {
+    if (resampler->deferred_ns[i] <= render_ns)
+      seq = resampler->deferred_seq[i];
+  }
+
+  if (seq <= resampler->signalled_seq)
+    return;
+
+  resampler->signalled_seq = seq;
+
+  if (g_writer == NULL)
+  {
+    finish_deferred(client, seq);
+  }
+  else
+  {
+    command_t marker;
+
+    memset(&marker, 0, sizeof(marker));
+    queue_command(g_writer, &marker, NULL, client, seq, 0);
+  }
+}
+
+// Plays back a single contact up to the given time. Returns 1 if anything
+// was sent, and sets *busy if there's more to come.
+static int render_track(client_t* client, surface_t* surface, int slot,
+  long long render_ns, int* busy)
+{
+  internal_state_t* state = surface->state;
+  resampler_t* resampler = &client->resampler;
+  track_t* track = &surface->tracks[slot];
+  command_t command;
+  int sent = 0;
+  int i;
+
+  if (track->count == 0)
+    return 0;
+
+  // One sample before the current one is all Catmull-Rom needs.
+  while (track->count > 2 && track->t[2] <= render_ns)
+    drop_sample(track);
+
+  for (i = track->count - 1; i > 0 && track->t[i] > render_ns; --i);
+
+  memset(&command, 0, sizeof(command));
+  command.type = 'm';
+  command.contact = slot;
+
+  if (i == track->count - 1 || track->t[i] > render_ns)
+  {
+    // Before the first sample or past the last one, all we can do is wait.
+    command.x = track->x[i];
+    command.y = track->y[i];
+    command.pressure = track->pressure[i];
+  }
+  else
+  {
+    double u = (double) (render_ns - track->t[i])
+      / (track->t[i + 1] - track->t[i]);
+
+    command.x = clamp(lround(interpolate(resampler->interpolation,
+      track->x, i, track->count, u)), 0, state->max_x);
+    command.y = clamp(lround(interpolate(resampler->interpolation,
+      track->y, i, track->count, u)), 0, state->max_y);
+    command.pressure = lround(interpolate(INTERPOLATE_LINEAR,
+      track->pressure, i, track->count, u));
+  }
+
+  if (render_ns < track->t[track->count - 1])
+    *busy = 1;
+
+  if (command.x != track->sent_x || command.y != track->sent_y
+      || command.pressure != track->sent_pressure)
+  {
+    submit_command(client, &command, state);
+    track->sent_x = command.x;
+    track->sent_y = command.y;
+    track->sent_pressure = command.pressure;
+    sent = 1;
+  }
+
+  if (track->lifting)
+  {
+    if (render_ns >= track->up_ns)
+    {
+      // The contact was held on to until now, so that nobody else could
+      // take it while its moves were still being played back.
+      command.type = 'u';
+      submit_command(client, &command, state);
+      release_slot(state, slot);
+      track->lifting = 0;
+      track->count = 0;
+      sent = 1;
+    }
+    else
+    {
+      *busy = 1;
+    }
+  }
+
+  return sent;
+}
+
+static void render_tracks(client_t* client, long long render_ns)
+{
+  command_t command;
+  int busy = 0;
+  int sent;
+  int slot;
+  int i;
+
+  memset(&command, 0, sizeof(command));
+  command.type = 'c';
+
+  for (i = 0; i < client->num_surfaces; ++i)
+  {
+    surface_t* surface = &client->surfaces[i];
+
+    sent = 0;
+
+    for (slot = 0; slot < surface->state->max_contacts; ++slot)
+    {
+      sent |= render_track(client, surface, slot, render_ns, &busy);
+    }
+
+    if (sent)
+      submit_command(NULL, &command, surface->state);
+  }
+
+  finish_rendered(client, render_ns);
+
+  if (!busy)
+    arm_resampler(&client->resampler, 0);
+}
+
+static void resample_tick(client_t* client)
+{
+  uint64_t expirations;
+
+  if (read(client->resampler.timer_fd, &expirations, sizeof(expirations)) < 0
+      && errno != EAGAIN)
+  {
+    perror("reading resampler timer");
+  }
+
+  render_tracks(client, monotonic_ns() - client->resampler.delay_ns);
+}
+
+// Plays out everything that's left right away.
+static void flush_resampler(client_t* client)
+{
+  int slot;
+  int i;
+
+  render_tracks(client, LLONG_MAX);
+
+  for (i = 0; i < client->num_surfaces; ++i)
+  {
+    for (slot = 0; slot < client->surfaces[i].state->max_contacts; ++slot)
+    {
+      client->surfaces[i].tracks[slot].count = 0;
+    }
+  }
+}
+
+static void configure_resampler(client_t* client, const command_t* command)
+{
+  resampler_t* resampler = &client->resampler;
+
+  if (resampler->enabled)
+  {
+    flush_resampler(client);
+    resampler->enabled = 0;
+  }
+
+  if (command->rate <= 0)
+    return;
+
+  resampler->period_ns = 1000000000LL / command->rate;
+  resampler->delay_ns = command->duration > 0
+    ? command->duration * 1000000LL : 0;
+  resampler->interpolation = command->interpolation == INTERPOLATE_CATMULL_ROM
+    ? INTERPOLATE_CATMULL_ROM : INTERPOLATE_LINEAR;
+  resampler->enabled = 1;
+}
+
+// Commits every surface that has been written to since the last commit,
+// each with a single write of its own. The current surface goes last, as
+// it's the one that carries the tag.
+static void commit_surfaces(client_t* client, const command_t* command)
+{
+  command_t untagged = *command;
+  int i;
+
+  untagged.tag = 0;
+
+  for (i = 0; i < client->num_surfaces; ++i)
+  {
+    surface_t* surface = &client->surfaces[i];
+
+    if (surface->num_stashed > 0)
+      run_stashed_moves(client, surface);
+
+    if (surface->dirty && surface != client->surface)
+      submit_command(NULL, &untagged, surface->state);
+
+    surface->dirty = 0;
+  }
+
+  submit_command(client, command, client->surface->state);
+}
+
+static void run_client_command(client_t* client, command_t* command)
+{
+  surface_t* surface = client->surface;
+  internal_state_t* state = surface->state;
+  int slot;
+
+  switch (command->type)
+  {
+    case 'd': // TOUCH DOWN
+    case 'm': // TOUCH MOVE
+      if ((slot = map_contact(surface, command->contact,
+          command->type == 'd')) < 0)
+        return;
+      command->contact = slot;
+
+      if (surface->transform.enabled)
+        apply_transform(&surface->transform, state, command);
+
+      if (client->resampler.enabled)
+      {
+        track_t* track = &surface->tracks[slot];
+
+        if (command->type == 'd')
+        {
+          track->count = 0;
+          track->sent_x = command->x;
+          track->sent_y = command->y;
+          track->sent_pressure = command->pressure;
+          add_sample(track, command, client->input.read_ns);
+        }
+        else
+        {
+          add_sample(track, command, client->input.read_ns);
+          arm_resampler(&client->resampler, 1);
+          return;
+        }
+      }
+
+      surface->dirty = 1;
+
+      if (command->type == 'm' && state->coalesce_moves)
+      {
+        stash_move(surface, command);
+        return;
+      }
+      break;
+    case 'u': // TOUCH UP
+      if ((slot = map_contact(surface, command->contact, 0)) < 0)
+        return;
+
+      if (client->resampler.enabled && surface->tracks[slot].count > 0)
+      {
+        // Lifted once the moves before it have been played back. The
+        // device contact stays owned until then.
+        surface->tracks[slot].lifting = 1;
+        surface->tracks[slot].up_ns = client->input.read_ns;
+        surface->contacts[command->contact] = -1;
+        arm_resampler(&client->resampler, 1);
+        return;
+      }
+
+      unmap_contact(surface, command->contact);
+      command->contact = slot;
+      surface->dirty = 1;
+      break;
+    case 'r': // RESET
+      if (client->resampler.enabled)
+        flush_resampler(client);
+
+      // Only the client's own contacts, as the others are still in use.
+      if (lift_contacts(client, surface) || surface->dirty)
+      {
+        command->type = 'c';
+        submit_command(NULL, command, state);
+        surface->dirty = 0;
+      }
+      return;
+    case 'c': // COMMIT
+      commit_surfaces(client, command);
+      return;
+  }
+
+  if (surface->num_stashed > 0)
+    run_stashed_moves(client, surface);
+
+  submit_command(client, command, state);
+}
+
+static void init_gesture(gesture_t* gesture, const command_t* command)
+{
+  memset(gesture, 0, sizeof(*gesture));
+  gesture->type = command->type;
+  gesture->pressure = command->pressure;
+  gesture->duration = command->duration > 0 ? command->duration : 0;
+  gesture->steps = command->steps > 0 ? command->steps : 1;
+
+  switch (command->type)
+  {
+    case 's': // SWIPE
+    case 'f': // FLING
+      gesture->num_contacts = 1;
+      gesture->contacts[0] = command->contact;
+      gesture->from_x[0] = command->x;
+      gesture->from_y[0] = command->y;
+      gesture->to_x[0] = command->x2;
+      gesture->to_y[0] = command->y2;
+      break;
+    case 'p': // PINCH
+      gesture->num_contacts = 2;
+      gesture->contacts[0] = command->contact;
+      gesture->contacts[1] = command->contact2;
+      gesture->from_x[0] = command->x - command->x2 / 2;
+      gesture->from_x[1] = command->x + command->x2 / 2;
+      gesture->to_x[0] = command->x - command->y2 / 2;
+      gesture->to_x[1] = command->x + command->y2 / 2;
+      gesture->from_y[0] = gesture->from_y[1] = command->y;
+      gesture->to_y[0] = gesture->to_y[1] = command->y;
+      break;
+    case 'l': // LONG PRESS
+      gesture->num_contacts = 1;
+      gesture->steps = 0;
+      gesture->contacts[0] = command->contact;
+      gesture->from_x[0] = gesture->to_x[0] = command->x;
+      gesture->from_y[0] = gesture->to_y[0] = command->y;
+      break;
+  }
+
+  gesture->active = 1;
+}
+
+static void start_gesture(client_t* client, const command_t* command)
+{
+  gesture_t* gesture = &client->gesture;
+
+  init_gesture(gesture, command);
+
+  if (g_verbose)
+    fprintf(stderr, "Starting gesture '%c' over %ld ms in %ld steps\n",
+      gesture->type, gesture->duration, gesture->steps);
+
+  anchor_schedule(&client->scheduler);
+  gesture->start = client->scheduler.deadline;
+}
+
+// Returns how far along the path the given step is, as a fraction of den.
+// Flings decelerate quadratically, everything else moves at a constant
+// speed.
+static long long gesture_progress(const gesture_t* gesture, long int step,
+  long long* den)
+{
+  long long steps = gesture->steps;
+
+  if (gesture->type == 'f')
+  {
+    *den = steps * steps;
+    return steps * steps - (steps - step) * (steps - step);
+  }
+
+  *den = steps;
+  return step;
+}
+
+// Fills in the commands for the given phase, one per contact followed by
+// a commit, and returns how many there are.
+static int gesture_phase_commands(const gesture_t* gesture, long int phase,
+  command_t* commands)
+{
+  long long num = 0;
+  long long den = 1;
+  char type;
+  int i;
+
+  if (phase == 0)
+  {
+    type = 'd';
+  }
+  else if (phase <= gesture->steps)
+  {
+    type = 'm';
+    num = gesture_progress(gesture, phase, &den);
+  }
+  else
+  {
+    type = 'u';
+  }
+
+  for (i = 0; i < gesture->num_contacts; ++i)
+  {
+    memset(&commands[i], 0, sizeof(commands[i]));
+    commands[i].type = type;
+    commands[i].contact = gesture->contacts[i];
+    commands[i].x = gesture->from_x[i]
+      + (gesture->to_x[i] - gesture->from_x[i]) * num / den;
+    commands[i].y = gesture->from_y[i]
+      + (gesture->to_y[i] - gesture->from_y[i]) * num / den;
+    commands[i].pressure = gesture->pressure;
+  }
+
+  memset(&commands[i], 0, sizeof(commands[i]));
+  commands[i].type = 'c';
+
+  return i + 1;
+}
+
+// Returns when the given phase is due, in milliseconds from the start.
+static long int gesture_phase_offset(const gesture_t* gesture, long int phase)
+{
+  if (phase == 0)
+    return 0;
+
+  if (phase > gesture->steps)
+    return gesture->duration;
+
+  return (long int) ((long long) gesture->duration * phase / gesture->steps);
+}
+
+static void run_gesture_phase(client_t* client)
+{
+  gesture_t* gesture = &client->gesture;
+  command_t commands[3];
+  int count;
+  int i;
+
+  count = gesture_phase_commands(gesture, gesture->phase, commands);
+
+  for (i = 0; i < count; ++i)
+  {
+    run_client_command(client, &commands[i]);
+  }
+
+  gesture->phase += 1;
+
+  if (gesture->phase > gesture->steps + 1)
+  {
+    gesture->active = 0;
+    return;
+  }
+
+  struct timespec deadline = gesture->start;
+
+  timespec_add_ms(&deadline, gesture_phase_offset(gesture, gesture->phase));
+  schedule_at(&client->scheduler, &deadline);
+}
+
+// Measures how long a command sat in the buffer after it became runnable,
+// i.e. since it was read or since the wait before it ended, whichever was
+// later.
+static void record_queue_delay(client_t* client)
+{
+  long long ready_ns = client->input.read_ns;
+
+  if (client->scheduler.anchored)
+  {
+    long long deadline_ns = client->scheduler.deadline.tv_sec * 1000000000LL
+      + client->scheduler.deadline.tv_nsec;
+
+    if (deadline_ns > ready_ns)
+      ready_ns = deadline_ns;
+  }
+
+  histogram_record(&g_stats.queue, monotonic_ns() - ready_ns);
+}
+
+static void complete_commit(client_t* client, unsigned long seq,
+  long long tag, long long read_ns, long long write_ns)
+{
+  if (seq > client->completed)
+    client->completed = seq;
+
+  update_written(client);
+
+  // Lets the client trace the commit from its own clock all the way to the
+  // write() that handed it to the kernel.
+  if (tag != 0)
+    output_printf(&client->output, "@ %lld %lld %lld\n", tag, read_ns,
+      write_ns);
+}
+
+// Acknowledgements are cumulative, so one per turn covers every commit we
+// got through, without a write() for each of them.
+static void send_ack(client_t* client)
+{
+  if (client->ack && client->acked != client->written)
+  {
+    output_printf(&client->output, "k %lu\n", client->written);
+    client->acked = client->written;
+  }
+}
+
+// Runs buffered commands until the client has to wait, runs out of input
+// or has had its fair share for this round. The cap keeps a single client
+// with a huge backlog from delaying everyone else.
+static void process_client(client_t* client)
+{
+  command_t command;
+  int processed = 0;
+
+  client->pending = 0;
+
+  if (client->output.overflowed)
+  {
+    return;
+  }
+
+  if (client->ring != NULL)
+  {
+    __atomic_store_n(client->ring->waiting, 0, __ATOMIC_RELAXED);
+
+    // Records don't come with a read time, so the turn stands in for it.
+    if (ring_backlog(client) > 0)
+      client->ring->read_ns = monotonic_ns();
+  }
+
+  while (!client->scheduler.waiting && !client->output.overflowed)
+  {
+    if (client->gesture.active)
+    {
+      run_gesture_phase(client);
+    }
+    else if (!next_client_command(client, &command))
+    {
+      break;
+    }
+    else
+    {
+      if (g_stats_enabled)
+        record_queue_delay(client);
+
+      switch (command.type)
+      {
+        case '?': // STATS
+          write_stats(&client->output);
+          break;
+        case 't': // SCREEN TRANSFORM
+          set_screen_transform(&client->surface->transform,
+            client->surface->state, command.x, command.y, command.rotation);
+          break;
+        case 'a': // AFFINE TRANSFORM
+          set_affine_transform(&client->surface->transform, command.matrix);
+          break;
+        case 'e': // SELECT DEVICE
+          if (command.x >= 0 && command.x < client->num_surfaces)
+            client->surface = &client->surfaces[command.x];
+          else if (g_verbose)
+            fprintf(stderr, "No such device %ld\n", command.x);
+          break;
+        case 'w': // WAIT
+          schedule_wait(&client->scheduler, command.wait);
+          break;
+        case 'i': // INTERPOLATE
+          configure_resampler(client, &command);
+          break;
+        case 'k': // ACK MODE
+          client->ack = command.x != 0;
+          client->acked = client->written;
+          break;
+        case 'q': // SHARED RING
+          attach_ring(client, command.x);
+          break;
+        case 'c': // COMMIT
+          client->commits += 1;
+
+          // If another frame of moves is already waiting behind this one,
+          // there's no point in sending this one first. Its moves stay
+          // stashed and are replaced by the newer ones where they overlap.
+          if (client->surface->state->coalesce_moves
+              && client->frame_moves_only && command.tag == 0
+              && client_frame_is_moves(client))
+          {
+            client->surface->state->frames_coalesced += 1;
+            break;
+          }
+
+          // The resampler commits moves on its own schedule.
+          if (client->resampler.enabled && client->frame_moves_only
+              && command.tag == 0)
+          {
+            defer_commit(client);
+            break;
+          }
+
+          client->frame_moves_only = 1;
+          run_client_command(client, &command);
+
+          // The writer thread reports back once the commit is through.
+          if (g_writer == NULL)
+            complete_commit(client, client->commits, command.tag,
+              client->input.read_ns, command.tag != 0 ? monotonic_ns() : 0);
+          break;
+        case 's': // SWIPE
+        case 'f': // FLING
+        case 'p': // PINCH
+        case 'l': // LONG PRESS
+          start_gesture(client, &command);
+          break;
+        default:
+          // The resampler plays back ups along with the moves.
+          if (command.type != 'm'
+              && !(command.type == 'u' && client->resampler.enabled))
+            client->frame_moves_only = 0;
+
+          run_client_command(client, &command);
+          break;
+      }
+    }
+
+    if (++processed == MAX_COMMANDS_PER_TURN)
+    {
+      client->pending = 1;
+      break;
+    }
+  }
+
+  if (g_verbose && processed > 0)
+    fprintf(stderr, "Ran %d commands for client %d\n", processed, client->fd);
+
+  send_ack(client);
+
+  if (client->ring != NULL)
+    park_ring(client);
+
+  if (!client->scheduler.waiting && !client->pending
+      && !client->gesture.active)
+  {
+    // Out of commands, so whatever comes next is relative to now.
+    client->scheduler.anchored = 0;
+  }
+}
+
+static void read_client(client_t* client)
+{
+  ssize_t result = fill_input(&client->input);
+
+  if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+  {
+    return;
+  }
+
+  if (result < 0)
+  {
+    perror("reading input");
+  }
+
+  if (result <= 0)
+  {
+    client->at_eof = 1;
+  }
+  else if (g_verbose)
+  {
+    fprintf(stderr, "Read %zd bytes from client %d\n", result, client->fd);
+  }
+}
+
+// A full buffer without a single complete line still needs to be read
+// into, so that fill_input() gets to throw the line away.
+static int client_has_room(client_t* client)
+{
+  input_buffer_t* input = &client->input;
+  size_t available = input->end - input->start;
+
+  if (available < sizeof(input->data) - 1)
+    return 1;
+
+  return !input->binary
+    && memchr(input->data + input->start, '\n', available) == NULL;
+}
+
+static int client_is_done(client_t* client)
+{
+  if (client->output.overflowed)
+    return 1;
+
+  // Moves the resampler is still playing back would otherwise all be sent
+  // at once.
+  return client->at_eof && !client->scheduler.waiting && !client->pending
+    && !client->gesture.active && !client->resampler.armed
+    && ring_backlog(client) == 0;
+}
+
+// Stops watching the input while the buffer is full, as level-triggered
+// epoll would otherwise wake us up continuously. Replies that didn't fit
+// into the socket wait for it to become writable.
+static void update_client_watch(server_t* server, client_t* client)
+{
+  int events = 0;
+  struct epoll_event event;
+
+  if (!client->at_eof && client_has_room(client))
+    events |= EPOLLIN;
+
+  if (client->output.fd == client->fd && output_pending(&client->output))
+    events |= EPOLLOUT;
+
+  if (client->ring != NULL && client->ring->epoll_fd < 0)
+  {
+    event.events = EPOLLIN;
+    event.data.ptr = &client->ring->watch;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, client->ring->doorbell_fd,
+        &event) < 0)
+      perror("epoll_ctl");
+    else
+      client->ring->epoll_fd = server->epoll_fd;
+  }
+
+  if (!client->pollable || events == client->events)
+  {
+    return;
+  }
+
+  event.events = events;
+  event.data.ptr = &client->input_watch;
+
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) < 0)
+  {
+    perror("epoll_ctl");
+  }
+
+  client->events = events;
+}
+
+static void free_client(client_t* client)
+{
+  int i;
+
+  if (client->scheduler.timer_fd >= 0)
+    close(client->scheduler.timer_fd);
+
+  if (client->resampler.timer_fd >= 0)
+    close(client->resampler.timer_fd);
+
+  detach_ring(client);
+
+  for (i = 0; i < client->input.num_passed_fds; ++i)
+    close(client->input.passed_fds[i]);
+
+  for (i = 0; i < client->num_surfaces; ++i)
+  {
+    free(client->surfaces[i].tracks);
+    free(client->surfaces[i].stashed_moves);
+    free(client->surfaces[i].contacts);
+  }
+
+  free(client->surfaces);
+  free(client);
+}
+
+static client_t* add_client(server_t* server, int fd, int output_fd)
+{
+  client_t* client = calloc(1, sizeof(client_t));
+  struct epoll_event event;
+  struct stat info;
+  int contact;
+  int i;
+
+  if (client == NULL)
+  {
+    perror("allocating client");
+    return NULL;
+  }
+
+  client->fd = fd;
+  client->output.fd = output_fd;
+  client->input.fd = fd;
+  client->input.socket = fstat(fd, &info) == 0 && S_ISSOCK(info.st_mode);
+  client->input_watch.kind = WATCH_INPUT;
+  client->input_watch.client = client;
+  client->timer_watch.kind = WATCH_TIMER;
+  client->timer_watch.client = client;
+  client->resampler.watch.kind = WATCH_RESAMPLE;
+  client->resampler.watch.client = client;
+  client->frame_moves_only = 1;
+
+  client->scheduler.timer_fd = client->resampler.timer_fd = -1;
+  client->surfaces = calloc(server->num_devices, sizeof(surface_t));
+
+  if (client->surfaces == NULL)
+  {
+    perror("allocating client surfaces");
+    free_client(client);
+    return NULL;
+  }
+
+  client->num_surfaces = server->num_devices;
+  client->surface = &client->surfaces[0];
+
+  for (i = 0; i < client->num_surfaces; ++i)
+  {
+    surface_t* surface = &client->surfaces[i];
+    internal_state_t* state = &server->devices[i];
+
+    surface->state = state;
+    surface->contacts = malloc(state->max_contacts * sizeof(int));
+    surface->stashed_moves = calloc(state->max_contacts, sizeof(command_t));
+    surface->tracks = calloc(state->max_contacts, sizeof(track_t));
+
+    if (surface->contacts == NULL || surface->stashed_moves == NULL
+        || surface->tracks == NULL)
+    {
+      perror("allocating client contacts");
+      free_client(client);
+      return NULL;
+    }
+
+    for (contact = 0; contact < state->max_contacts; ++contact)
+    {
+      surface->contacts[contact] = -1;
+    }
+  }
+
+  client->scheduler.timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+  client->resampler.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+  if (client->scheduler.timer_fd < 0 || client->resampler.timer_fd < 0)
+  {
+    perror("timerfd_create");
+    free_client(client);
+    return NULL;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &client->timer_watch;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, client->scheduler.timer_fd,
+    &event);
+
+  event.events = EPOLLIN;
+  event.data.ptr = &client->resampler.watch;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, client->resampler.timer_fd,
+    &event);
+
+  event.events = EPOLLIN;
+  event.data.ptr = &client->input_watch;
+
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0)
+  {
+    client->pollable = 1;
+    client->events = EPOLLIN;
+  }
+  else if (errno != EPERM)
+  {
+    perror("epoll_ctl");
+    free_client(client);
+    return NULL;
+  }
+
+  // Regular files cannot be watched with epoll (EPERM), but they are
+  // always readable anyway, so they are simply read on every round.
+
+  send_banner(&client->output, server->devices, server->num_devices);
+
+  client->next = server->clients;
+  server->clients = client;
+
+  return client;
+}
+
+static void handle_completions(server_t* server)
+{
+  writer_t* writer = g_writer;
+  unsigned long head = writer->completion_head;
+  client_t* client;
+
+  drain_fd(writer->completion_fd);
+
+  while (head != __atomic_load_n(&writer->completion_tail, __ATOMIC_ACQUIRE))
+  {
+    completion_t* completion = &writer->completions[head % WRITER_QUEUE_SIZE];
+
+    if (completion->resampled)
+      finish_deferred(completion->client, completion->seq);
+    else
+      complete_commit(completion->client, completion->seq, completion->tag,
+        completion->read_ns, completion->write_ns);
+
+    __atomic_store_n(&writer->completion_head, ++head, __ATOMIC_RELEASE);
+  }
+
+  for (client = server->clients; client != NULL; client = client->next)
+  {
+    send_ack(client);
+  }
+}
+
+static void remove_client(server_t* server, client_t* client)
+{
+  client_t** link;
+  command_t command;
+  int i;
+
+  if (client->resampler.enabled)
+  {
+    flush_resampler(client);
+
+    // The flush may have queued markers that point back at the client.
+    if (g_writer != NULL)
+    {
+      sync_writer(g_writer);
+      handle_completions(server);
+    }
+  }
+
+  memset(&command, 0, sizeof(command));
+  command.type = 'c';
+
+  for (i = 0; i < client->num_surfaces; ++i)
+  {
+    if (lift_contacts(client, &client->surfaces[i]))
+      submit_command(NULL, &command, client->surfaces[i].state);
+  }
+
+  for (link = &server->clients; *link != NULL; link = &(*link)->next)
+  {
+    if (*link == client)
+    {
+      *link = client->next;
+      break;
+    }
+  }
+
+  if (client->pollable)
+  {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  }
+
+  free_client(client);
+}
+
+static void accept_client(server_t* server)
+{
+  struct sockaddr_un client_addr;
+  socklen_t client_addr_length = sizeof(client_addr);
+  int client_fd = accept(server->server_fd, (struct sockaddr *) &client_addr,
+    &client_addr_length);
+
+  if (client_fd < 0)
+  {
+    perror("accepting client");
+    return;
+  }
+
+  fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+  if (add_client(server, client_fd, client_fd) == NULL)
+  {
+    close(client_fd);
+    return;
+  }
+
+  fprintf(stderr, "Connection established\n");
+}
+
+// Serves any number of clients from a single thread. When server_fd is
+// negative, only the clients added beforehand are served, and the loop
+// ends once they are all done.
+static void event_loop(server_t* server)
+{
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  int i;
+
+  while (server->server_fd >= 0 || server->clients != NULL)
+  {
+    client_t* client;
+    client_t* next;
+    int timeout = -1;
+    int count;
+
+    for (client = server->clients; client != NULL; client = client->next)
+    {
+      if (client->pending
+          || (!client->pollable && !client->at_eof && client_has_room(client)))
+      {
+        timeout = 0;
+      }
+    }
+
+    count = epoll_wait(server->epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      perror("epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+      watch_t* watch = events[i].data.ptr;
+
+      switch (watch->kind)
+      {
+        case WATCH_SERVER:
+          accept_client(server);
+          break;
+        case WATCH_INPUT:
+          // Replies are written out for every client below anyway.
+          if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)
+              && !watch->client->at_eof && client_has_room(watch->client))
+            read_client(watch->client);
+          break;
+        case WATCH_TIMER:
+          finish_wait(&watch->client->scheduler);
+          break;
+        case WATCH_WRITER:
+          handle_completions(server);
+          break;
+        case WATCH_RESAMPLE:
+          resample_tick(watch->client);
+          break;
+        case WATCH_RING:
+          if (events[i].events & (EPOLLHUP | EPOLLERR))
+          {
+            fprintf(stderr, "Shared ring doorbell failed, detaching ring\n");
+            detach_ring(watch->client);
+          }
+          else
+          {
+            drain_fd(watch->client->ring->doorbell_fd);
+          }
+          break;
+      }
+    }
+
+    for (client = server->clients; client != NULL; client = next)
+    {
+      next = client->next;
+
+      if (!client->pollable && !client->at_eof && client_has_room(client))
+      {
+        read_client(client);
+      }
+
+      process_client(client);
+      flush_output(&client->output);
+
+      if (client_is_done(client))
+      {
+        // Make sure the client hears about all of its commits before it
+        // goes away.
+        if (g_writer != NULL)
+        {
+          sync_writer(g_writer);
+          handle_completions(server);
+          flush_output(&client->output);
+        }
+
+        if (client->output.fd == client->fd && !client->output.overflowed
+            && output_pending(&client->output))
+        {
+          update_client_watch(server, client);
+          continue;
+        }
+
+        if (server->server_fd >= 0)
+        {
+          fprintf(stderr, "Connection closed\n");
+          close(client->fd);
+        }
+
+        remove_client(server, client);
+        continue;
+      }
+
+      update_client_watch(server, client);
+    }
+  }
+
+  for (i = 0; g_verbose && i < server->num_devices; ++i)
+  {
+    internal_state_t* state = &server->devices[i];
+
+    fprintf(stderr, "Flushed events to %s in %lu writes (%lu syscalls saved, "
+      "%lu events suppressed, %lu frames coalesced)\n", state->path,
+      state->num_flushes, state->syscalls_saved, state->events_suppressed,
+      state->frames_coalesced);
+  }
+}
+
+static int init_server(server_t* server, int server_fd,
+  internal_state_t* devices, int num_devices)
+{
+  struct epoll_event event;
+
+  server->clients = NULL;
+  server->devices = devices;
+  server->num_devices = num_devices;
+  server->server_fd = server_fd;
+  server->server_watch.kind = WATCH_SERVER;
+  server->server_watch.client = NULL;
+  server->epoll_fd = epoll_create(MAX_EPOLL_EVENTS);
+
+  if (server->epoll_fd < 0)
+  {
+    perror("epoll_create");
+    return -1;
+  }
+
+  if (server_fd >= 0)
+  {
+    event.events = EPOLLIN;
+    event.data.ptr = &server->server_watch;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server_fd, &event) < 0)
+    {
+      perror("epoll_ctl");
+      close(server->epoll_fd);
+      return -1;
+    }
+  }
+
+  if (g_writer != NULL)
+  {
+    server->writer_watch.kind = WATCH_WRITER;
+    server->writer_watch.client = NULL;
+    event.events = EPOLLIN;
+    event.data.ptr = &server->writer_watch;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, g_writer->completion_fd,
+        &event) < 0)
+    {
+      perror("epoll_ctl");
+      close(server->epoll_fd);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void io_handler(int input_fd, int output_fd,
+  internal_state_t* devices, int num_devices)
+{
+  server_t server;
+
+  if (init_server(&server, -1, devices, num_devices) != 0)
+  {
+    return;
+  }
+
+  if (add_client(&server, input_fd, output_fd) != NULL)
+  {
+    event_loop(&server);
+  }
+
+  close(server.epoll_fd);
+}
+
+// A precompiled -f script. Waits and gestures only exist while compiling;
+// what's left is a flat list of device commands, each with the time it's
+// due at relative to the start of the replay.
+typedef struct
+{
+  long long due_ns;
+  char type;
+  int device;
+  int contact;
+  int x;
+  int y;
+  int pressure;
+} replay_step_t;
+
+typedef struct
+{
+  replay_step_t* steps;
+  size_t count;
+  size_t capacity;
+  long long due_ns;
+  internal_state_t* devices;
+  int num_devices;
+  int device;
+  int dirty[MAX_DEVICES];
+  transform_t transforms[MAX_DEVICES];
+} timeline_t;
+
+static int add_replay_step(timeline_t* timeline, const command_t* command)
+{
+  internal_state_t* state = &timeline->devices[timeline->device];
+  transform_t* transform = &timeline->transforms[timeline->device];
+  replay_step_t* step;
+  command_t transformed = *command;
+
+  switch (command->type)
+  {
+    case 'd': // TOUCH DOWN
+    case 'm': // TOUCH MOVE
+    case 'u': // TOUCH UP
+      if (command->contact < 0 || command->contact >= state->max_contacts)
+      {
+        fprintf(stderr, "Skipping command for unknown contact %ld\n",
+          command->contact);
+        return 0;
+      }
+
+      if (command->type != 'u' && transform->enabled)
+        apply_transform(transform, state, &transformed);
+
+      timeline->dirty[timeline->device] = 1;
+      break;
+    case 'r': // RESET
+      timeline->dirty[timeline->device] = 1;
+      break;
+    case 'c': // COMMIT
+    case '?': // STATS
+      break;
+    default:
+      return 0;
+  }
+
+  if (timeline->count == timeline->capacity)
+  {
+    size_t capacity = timeline->capacity ? timeline->capacity * 2 : 4096;
+    replay_step_t* steps = realloc(timeline->steps,
+      capacity * sizeof(*steps));
+
+    if (steps == NULL)
+    {
+      perror("realloc");
+      return -1;
+    }
+
+    timeline->steps = steps;
+    timeline->capacity = capacity;
+  }
+
+  step = &timeline->steps[timeline->count++];
+  step->due_ns = timeline->due_ns;
+  step->type = transformed.type;
+  step->device = timeline->device;
+  step->contact = transformed.contact;
+  step->x = transformed.x;
+  step->y = transformed.y;
+  step->pressure = transformed.pressure;
+
+  return 0;
+}
+
+static int compile_command(timeline_t* timeline, const command_t* command)
+{
+  int device = timeline->device;
+  gesture_t gesture;
+  command_t commands[3];
+  long long start_ns;
+  long int phase;
+  int count;
+  int i;
+
+  switch (command->type)
+  {
+    case 'w': // WAIT
+      if (command->wait > 0)
+        timeline->due_ns += command->wait * 1000000LL;
+      return 0;
+    case 't': // SCREEN TRANSFORM
+      set_screen_transform(&timeline->transforms[device],
+        &timeline->devices[device], command->x, command->y,
+        command->rotation);
+      return 0;
+    case 'a': // AFFINE TRANSFORM
+      set_affine_transform(&timeline->transforms[device], command->matrix);
+      return 0;
+    case 'e': // SELECT DEVICE
+      if (command->x >= 0 && command->x < timeline->num_devices)
+        timeline->device = command->x;
+      else
+        fprintf(stderr, "Skipping selection of unknown device %ld\n",
+          command->x);
+      return 0;
+    case 'c': // COMMIT
+      // Just like for clients, every device written to gets its own commit,
+      // with the current one last.
+      for (i = 0; i < timeline->num_devices; ++i)
+      {
+        if (i != device && timeline->dirty[i])
+        {
+          timeline->device = i;
+
+          if (add_replay_step(timeline, command) != 0)
+            return -1;
+        }
+
+        timeline->dirty[i] = 0;
+      }
+
+      timeline->device = device;
+      return add_replay_step(timeline, command);
+    case 's': // SWIPE
+    case 'f': // FLING
+    case 'p': // PINCH
+    case 'l': // LONG PRESS
+      init_gesture(&gesture, command);
+      start_ns = timeline->due_ns;
+
+      for (phase = 0; phase <= gesture.steps + 1; ++phase)
+      {
+        timeline->due_ns = start_ns
+          + gesture_phase_offset(&gesture, phase) * 1000000LL;
+        count = gesture_phase_commands(&gesture, phase, commands);
+
+        for (i = 0; i < count; ++i)
+        {
+          if (compile_command(timeline, &commands[i]) != 0)
+            return -1;
+        }
+      }
+      return 0;
+    default:
+      return add_replay_step(timeline, command);
+  }
+}
+
+// Parses the whole script up front. The file is mapped privately so that
+// lines can be terminated in place, just like in the input buffer.
+static int compile_script(const char* path, timeline_t* timeline)
+{
+  struct stat info;
+  command_t command;
+  char* data;
+  char last[256];
+  size_t offset = 0;
+  int binary = 0;
+  int result = 0;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &info) < 0)
+  {
+    fprintf(stderr, "Unable to open '%s': %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (info.st_size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+
+  data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED)
+  {
+    perror("mmap");
+    return -1;
+  }
+
+  while (offset < (size_t) info.st_size && result == 0)
+  {
+    char* line = data + offset;
+    size_t available = info.st_size - offset;
+
+    if (binary)
+    {
+      if (available < BINARY_RECORD_SIZE)
+      {
+        fprintf(stderr, "Ignoring truncated binary record at the end\n");
+        break;
+      }
+
+      parse_binary_command((unsigned char*) line, &command);
+      offset += BINARY_RECORD_SIZE;
+      result = compile_command(timeline, &command);
+      continue;
+    }
+
+    char* newline = memchr(line, '\n', available);
+
+    if (newline != NULL)
+    {
+      *newline = '\0';
+      offset = newline - data + 1;
+    }
+    else
+    {
+      // There's no room to terminate the last line in the mapping.
+      snprintf(last, sizeof(last), "%.*s", (int) available, line);
+      line = last;
+      offset = info.st_size;
+    }
+
+    line[strcspn(line, "\r")] = '\0';
+
+    if (line[0] == 'b')
+    {
+      binary = 1;
+      continue;
+    }
+
+    parse_text_command(line, &command);
+    result = compile_command(timeline, &command);
+  }
+
+  munmap(data, info.st_size);
+
+  return result;
+}
+
+// Plays back a compiled script against absolute deadlines and reports how
+// far behind schedule it ran.
+static void play_timeline(const timeline_t* timeline)
+{
+  static histogram_t lateness;
+  static output_buffer_t report;
+  struct timespec deadline;
+  long long start_ns;
+  long long due_ns = 0;
+  long long deadline_ns;
+  size_t commits = 0;
+  size_t i;
+
+  report.fd = STDERR_FILENO;
+  start_ns = monotonic_ns();
+
+  for (i = 0; i < timeline->count; ++i)
+  {
+    const replay_step_t* step = &timeline->steps[i];
+    internal_state_t* state = &timeline->devices[step->device];
+
+    if (step->due_ns > due_ns)
+    {
+      due_ns = step->due_ns;
+      deadline_ns = start_ns + due_ns;
+      deadline.tv_sec = deadline_ns / 1000000000;
+      deadline.tv_nsec = deadline_ns % 1000000000;
+
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+          NULL) == EINTR);
+
+      histogram_record(&lateness, monotonic_ns() - deadline_ns);
+    }
+
+    switch (step->type)
+    {
+      case 'c': // COMMIT
+        commit(state);
+        commits += 1;
+        break;
+      case 'r': // RESET
+        touch_panic_reset_all(state);
+        break;
+      case 'd': // TOUCH DOWN
+        touch_down(state, step->contact, step->x, step->y, step->pressure);
+        break;
+      case 'm': // TOUCH MOVE
+        touch_move(state, step->contact, step->x, step->y, step->pressure);
+        break;
+      case 'u': // TOUCH UP
+        touch_up(state, step->contact);
+        break;
+      case '?': // STATS
+        write_stats(&report);
+        flush_output(&report);
+        break;
+    }
+  }
+
+  fprintf(stderr,
+    "Replayed %zu commands with %zu commits in %lld ms, scheduled %lld ms\n",
+    timeline->count, commits, (monotonic_ns() - start_ns) / 1000000,
+    due_ns / 1000000);
+  write_histogram(&report, "late", &lateness);
+  flush_output(&report);
+}
+
+static int replay_script(const char* path, internal_state_t* devices,
+  int num_devices)
+{
+  timeline_t timeline;
+  int result;
+
+  memset(&timeline, 0, sizeof(timeline));
+  timeline.devices = devices;
+  timeline.num_devices = num_devices;
+
+  if ((result = compile_script(path, &timeline)) == 0)
+  {
+    if (g_verbose)
+      fprintf(stderr, "Compiled '%s' into %zu commands\n", path,
+        timeline.count);
+
+    play_timeline(&timeline);
+  }
+
+  free(timeline.steps);
+
+  return result;
+}
+
+// A contact as seen on the device while recording.
+typedef struct
+{
+  int active;
+  int down;
+  int dirty;
+  int x;
+  int y;
+  int pressure;
+} recorded_contact_t;
+
+typedef struct
+{
+  FILE* output;
+  recorded_contact_t* contacts;
+  int num_contacts;
+  int slot;
+  int dropping;
+  // Type A devices report anonymous contacts one SYN_MT_REPORT at a time,
+  // so we collect them here until the frame ends.
+  recorded_contact_t pending;
+  int num_reported;
+  int started;
+  long long start_us;
+  long long last_us;
+  long long waited_ms;
+} recorder_t;
+
+static volatile sig_atomic_t g_stop_recording = 0;
+
+static void stop_recording(int signum)
+{
+  g_stop_recording = 1;
+}
+
+static long long event_time_us(const struct input_event* event)
+{
+  return (long long) event->time.tv_sec * 1000000 + event->time.tv_usec;
+}
+
+static int recorded_frame_changed(recorder_t* recorder)
+{
+  int i;
+
+  for (i = 0; i < recorder->num_contacts; ++i)
+  {
+    recorded_contact_t* contact = &recorder->contacts[i];
+
+    if (contact->active != contact->down || (contact->active && contact->dirty))
+      return 1;
+  }
+
+  return 0;
+}
+
+// Writes out whatever changed since the previous frame as one commit,
+// preceded by a wait that reproduces the original timing.
+static void write_recorded_frame(recorder_t* recorder, long long time_us)
+{
+  long long wait_ms;
+  int i;
+
+  if (!recorded_frame_changed(recorder))
+    return;
+
+  if (!recorder->started)
+  {
+    recorder->started = 1;
+    recorder->start_us = time_us;
+  }
+
+  recorder->last_us = time_us;
+
+  // Measure from the first frame rather than the previous one so that
+  // rounding errors don't add up over a long recording.
+  wait_ms = (time_us - recorder->start_us) / 1000 - recorder->waited_ms;
+
+  if (wait_ms > 0)
+  {
+    fprintf(recorder->output, "w %lld\n", wait_ms);
+    recorder->waited_ms += wait_ms;
+  }
+
+  for (i = 0; i < recorder->num_contacts; ++i)
+  {
+    recorded_contact_t* contact = &recorder->contacts[i];
+
+    if (contact->active && !contact->down)
+    {
+      fprintf(recorder->output, "d %d %d %d %d\n", i, contact->x, contact->y,
+        contact->pressure);
+      contact->down = 1;
+    }
+    else if (contact->active && contact->dirty)
+    {
+      fprintf(recorder->output, "m %d %d %d %d\n", i, contact->x, contact->y,
+        contact->pressure);
+    }
+    else if (!contact->active && contact->down)
+    {
+      fprintf(recorder->output, "u %d\n", i);
+      contact->down = 0;
+    }
+
+    contact->dirty = 0;
+  }
+
+  fprintf(recorder->output, "c\n");
+}
+
+static void record_abs_event(recorder_t* recorder,
+  internal_state_t* state, const struct input_event* event)
+{
+  recorded_contact_t* contact;
+
+  if (!state->has_mtslot)
+  {
+    contact = &recorder->pending;
+  }
+  else if (event->code == ABS_MT_SLOT)
+  {
+    recorder->slot = event->value;
+    return;
+  }
+  else if (recorder->slot < 0 || recorder->slot >= recorder->num_contacts)
   {
-    return type_b_touch_move(state, contact, x, y, pressure);
+    return;
   }
   else
   {
-    return type_a_touch_move(state, contact, x, y, pressure);
+    contact = &recorder->contacts[recorder->slot];
   }
-}
 
-static int touch_up(internal_state_t* state, int contact)
-{
-  if (state->has_mtslot)
-  {
-    return type_b_touch_up(state, contact);
-  }
-  else
+  switch (event->code)
   {
-    return type_a_touch_up(state, contact);
+    case ABS_MT_TRACKING_ID:
+      if (state->has_mtslot)
+        contact->active = event->value != -1;
+      break;
+    case ABS_MT_POSITION_X:
+      contact->x = event->value;
+      contact->dirty = 1;
+      break;
+    case ABS_MT_POSITION_Y:
+      contact->y = event->value;
+      contact->dirty = 1;
+      break;
+    case ABS_MT_PRESSURE:
+      contact->pressure = event->value;
+      contact->dirty = 1;
+      break;
   }
 }
 
-static int touch_panic_reset_all(internal_state_t* state)
+static void record_syn_event(recorder_t* recorder,
+  internal_state_t* state, const struct input_event* event)
 {
-  if (state->has_mtslot)
-  {
-    return type_b_touch_panic_reset_all(state);
-  }
-  else
+  int i;
+
+  switch (event->code)
   {
-    return type_a_touch_panic_reset_all(state);
+    case SYN_MT_REPORT:
+      // Type A contacts have no identity, so they're matched to the ones in
+      // the previous frame by the order they're reported in.
+      if (recorder->pending.dirty
+          && recorder->num_reported < recorder->num_contacts)
+      {
+        recorded_contact_t* contact =
+          &recorder->contacts[recorder->num_reported++];
+
+        contact->active = 1;
+        contact->dirty = contact->x != recorder->pending.x
+          || contact->y != recorder->pending.y
+          || contact->pressure != recorder->pending.pressure;
+        contact->x = recorder->pending.x;
+        contact->y = recorder->pending.y;
+        contact->pressure = recorder->pending.pressure;
+      }
+
+      recorder->pending.dirty = 0;
+      break;
+    case SYN_DROPPED:
+      // The rest of the frame is lost. Skip to the next SYN_REPORT and pick
+      // up from there.
+      if (g_verbose)
+        fprintf(stderr, "Device dropped events while recording\n");
+      recorder->dropping = 1;
+      break;
+    case SYN_REPORT:
+      if (recorder->dropping)
+      {
+        recorder->dropping = 0;
+      }
+      else
+      {
+        if (!state->has_mtslot)
+        {
+          for (i = recorder->num_reported; i < recorder->num_contacts; ++i)
+            recorder->contacts[i].active = 0;
+
+          recorder->num_reported = 0;
+        }
+
+        write_recorded_frame(recorder, event_time_us(event));
+      }
+      break;
   }
 }
 
-static int commit(internal_state_t* state)
+// Picks up the slot and contacts a Type B device already has, as the kernel
+// only reports the slot and per-slot values when they change. Contacts that
+// are already down are written out with the first frame.
+static void seed_recorder(recorder_t* recorder, internal_state_t* state)
 {
-  if (state->has_mtslot)
+  static const int codes[] = {
+    ABS_MT_TRACKING_ID, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_PRESSURE
+  };
+  struct input_absinfo absinfo;
+  int32_t* values;
+  size_t size = (recorder->num_contacts + 1) * sizeof(int32_t);
+  size_t i;
+  int slot;
+
+  if (!state->has_mtslot)
+    return;
+
+  if (ioctl(state->fd, EVIOCGABS(ABS_MT_SLOT), &absinfo) < 0
+      || (values = malloc(size)) == NULL)
   {
-    return type_b_commit(state);
+    if (g_verbose)
+      fprintf(stderr, "Unable to read the current slots, assuming none\n");
+    return;
   }
-  else
+
+  recorder->slot = absinfo.value;
+
+  for (i = 0; i < sizeof(codes) / sizeof(codes[0]); ++i)
   {
-    return type_a_commit(state);
+    values[0] = codes[i];
+
+    if (ioctl(state->fd, EVIOCGMTSLOTS(size), values) < 0)
+      continue;
+
+    for (slot = 0; slot < recorder->num_contacts; ++slot)
+    {
+      recorded_contact_t* contact = &recorder->contacts[slot];
+
+      switch (codes[i])
+      {
+        case ABS_MT_TRACKING_ID:
+          contact->active = values[slot + 1] != -1;
+          break;
+        case ABS_MT_POSITION_X:
+          contact->x = values[slot + 1];
+          break;
+        case ABS_MT_POSITION_Y:
+          contact->y = values[slot + 1];
+          break;
+        case ABS_MT_PRESSURE:
+          contact->pressure = values[slot + 1];
+          break;
+      }
+    }
   }
+
+  free(values);
 }
 
-static int start_server(char* sockname)
+// Reads events from the touch device until interrupted, reconstructing the
+// contacts from the Type A or Type B stream and writing them out as a
+// script that -f replays with the same timing.
+static int record_device(internal_state_t* state, FILE* output)
 {
-  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-
-  if (fd < 0)
-  {
-    perror("creating socket");
-    return fd;
-  }
+  struct input_event events[64];
+  recorder_t recorder = {0};
+  struct sigaction action = {0};
+  ssize_t result;
+  size_t i;
+  int clock = CLOCK_MONOTONIC;
 
-  struct sockaddr_un addr;
-  memset(&addr, 0, sizeof(addr));
-  addr.sun_family = AF_UNIX;
-  strncpy(&addr.sun_path[1], sockname, strlen(sockname));
+  recorder.output = output;
+  recorder.num_contacts = state->max_contacts;
+  recorder.contacts = calloc(recorder.num_contacts, sizeof(*recorder.contacts));
 
-  if (bind(fd, (struct sockaddr*) &addr,
-    sizeof(sa_family_t) + strlen(sockname) + 1) < 0)
+  if (recorder.contacts == NULL)
   {
-    perror("binding socket");
-    close(fd);
+    perror("calloc");
     return -1;
   }
 
-  listen(fd, 1);
-
-  return fd;
-}
+  // Wall clock adjustments would otherwise end up in the waits.
+  if (ioctl(state->fd, EVIOCSCLOCKID, &clock) < 0 && g_verbose)
+    fprintf(stderr, "Unable to use monotonic timestamps, using device default\n");
 
-static void parse_input(char* buffer, internal_state_t* state)
-{
-  char* cursor;
-  long int contact, x, y, pressure, wait;
+  seed_recorder(&recorder, state);
 
-  cursor = (char*) buffer;
-  cursor += 1;
+  // No SA_RESTART, so that a signal breaks out of read().
+  action.sa_handler = stop_recording;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
 
-  switch (buffer[0])
+  while (!g_stop_recording)
   {
-    case 'c': // COMMIT
-      commit(state);
-      break;
-    case 'r': // RESET
-      touch_panic_reset_all(state);
-      break;
-    case 'd': // TOUCH DOWN
-      contact = strtol(cursor, &cursor, 10);
-      x = strtol(cursor, &cursor, 10);
-      y = strtol(cursor, &cursor, 10);
-      pressure = strtol(cursor, &cursor, 10);
-      touch_down(state, contact, x, y, pressure);
-      break;
-    case 'm': // TOUCH MOVE
-      contact = strtol(cursor, &cursor, 10);
-      x = strtol(cursor, &cursor, 10);
-      y = strtol(cursor, &cursor, 10);
-      pressure = strtol(cursor, &cursor, 10);
-      touch_move(state, contact, x, y, pressure);
-      break;
-    case 'u': // TOUCH UP
-      contact = strtol(cursor, &cursor, 10);
-      touch_up(state, contact);
-      break;
-    case 'w':
-      wait = strtol(cursor, &cursor, 10);
-      if (g_verbose)
-        fprintf(stderr, "Waiting %ld ms\n", wait);
-      usleep(wait * 1000);
+    if ((result = read(state->fd, events, sizeof(events))) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      perror("read");
       break;
-    default:
+    }
+
+    if (result == 0)
       break;
+
+    for (i = 0; i < result / sizeof(events[0]); ++i)
+    {
+      if (recorder.dropping && events[i].type != EV_SYN)
+        continue;
+
+      switch (events[i].type)
+      {
+        case EV_ABS:
+          record_abs_event(&recorder, state, &events[i]);
+          break;
+        case EV_SYN:
+          record_syn_event(&recorder, state, &events[i]);
+          break;
+      }
+    }
+  }
+
+  // Lift anything still down so that the script leaves the device clean.
+  for (i = 0; i < (size_t) recorder.num_contacts; ++i)
+  {
+    recorder.contacts[i].active = 0;
   }
+
+  write_recorded_frame(&recorder, recorder.last_us);
+
+  free(recorder.contacts);
+  fflush(output);
+
+  return 0;
 }
 
-static void io_handler(FILE* input, FILE* output, internal_state_t* state)
+static char g_agent_header[256];
+static size_t g_agent_header_length = 0;
+
+// The agent only introduces itself once, right after we connect, but every
+// client expects to see the header. It's read a byte at a time so that we
+// don't swallow anything that follows it.
+static int read_agent_header(int proxy_fd)
 {
-  setvbuf(input, NULL, _IOLBF, 1024);
-  setvbuf(output, NULL, _IOLBF, 1024);
+  int lines = 0;
+  ssize_t result;
 
-  // Tell version
-  fprintf(output, "v %d\n", VERSION);
+  while (lines < 2)
+  {
+    if (g_agent_header_length == sizeof(g_agent_header))
+    {
+      fprintf(stderr, "Agent header is too long\n");
+      return -1;
+    }
 
-  // Tell limits
-  fprintf(output, "^ %d %d %d %d\n",
-          state->max_contacts, state->max_x, state->max_y, state->max_pressure);
+    result = read(proxy_fd, g_agent_header + g_agent_header_length, 1);
 
-  // Tell pid
-  fprintf(output, "$ %d\n", getpid());
+    if (result < 0 && errno == EINTR)
+      continue;
 
-  char read_buffer[80];
+    if (result <= 0)
+    {
+      fprintf(stderr, "Unable to read header from agent\n");
+      return -1;
+    }
 
-  while (fgets(read_buffer, sizeof(read_buffer), input) != NULL)
-  {
-    read_buffer[strcspn(read_buffer, "\r\n")] = 0;
-    parse_input(read_buffer, state);
+    if (g_agent_header[g_agent_header_length++] == '\n')
+      lines += 1;
   }
+
+  return 0;
 }
 
-static void proxy_handler(FILE* input, FILE* output, int proxy_fd)
+static int write_fully(int fd, const char* data, size_t length)
 {
-  char read_buffer[80];
-  FILE* proxy_input;
-  FILE* proxy_output;
-  proxy_input = fdopen(proxy_fd, "r");
-  if (proxy_input == NULL)
-  {
-    fprintf(stderr, "%s: fdopen(proxy_fd,'r')\n", strerror(errno));
-    exit(1);
-  }
-  proxy_output = fdopen(dup(proxy_fd), "w");
-  if (proxy_output == NULL)
+  ssize_t written;
+
+  while (length > 0)
   {
-    fprintf(stderr, "%s: fdopen(proxy_fd,'w')\n", strerror(errno));
-    exit(1);
+    if ((written = write(fd, data, length)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    data += written;
+    length -= written;
   }
-  setvbuf(proxy_input, NULL, _IOLBF, 1024);
-  setvbuf(proxy_output, NULL, _IOLBF, 1024);
 
-  // Get version from the agent
-  fgets(read_buffer, sizeof(read_buffer), proxy_input);
-  fprintf(output, "%s", read_buffer);
+  return 0;
+}
+
+// Relays data between a client and the agent in both directions, in chunks
+// as large as whatever is available, until the client goes away. Returns
+// -1 if the agent went away instead.
+static int proxy_handler(int input_fd, int output_fd, int proxy_fd)
+{
+  static char buffer[PROXY_BUFFER_SIZE];
+  struct pollfd fds[2];
+  char pid_line[32];
+  ssize_t result;
+  int length;
 
-  // Get the poiner x-y range from the agent
-  fgets(read_buffer, sizeof(read_buffer), proxy_input);
-  fprintf(output, "%s", read_buffer);
+  if (g_agent_header_length == 0 && read_agent_header(proxy_fd) != 0)
+    return -1;
 
   // Tell pid
-  fprintf(output, "$ %d\n", getpid());
-  fflush(output);
+  length = snprintf(pid_line, sizeof(pid_line), "$ %d\n", getpid());
 
-  // Forward every event to the agent
-  while (fgets(read_buffer, sizeof(read_buffer), input) != NULL)
+  if (write_fully(output_fd, g_agent_header, g_agent_header_length) != 0
+      || write_fully(output_fd, pid_line, length) != 0)
+    return 0;
+
+  fds[0].fd = input_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = proxy_fd;
+  fds[1].events = POLLIN;
+
+  while (1)
   {
-    fprintf(proxy_output, "%s", read_buffer);
+    if (poll(fds, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      perror("poll");
+      return 0;
+    }
+
+    if (fds[1].revents != 0)
+    {
+      if ((result = read(proxy_fd, buffer, sizeof(buffer))) <= 0)
+      {
+        if (result < 0 && errno == EINTR)
+          continue;
+
+        fprintf(stderr, "Agent connection closed\n");
+        return -1;
+      }
+
+      if (write_fully(output_fd, buffer, result) != 0)
+        return 0;
+    }
+
+    if (fds[0].revents != 0)
+    {
+      if ((result = read(input_fd, buffer, sizeof(buffer))) <= 0)
+      {
+        if (result < 0 && errno == EINTR)
+          continue;
+
+        return 0;
+      }
+
+      if (write_fully(proxy_fd, buffer, result) != 0)
+      {
+        perror("writing to agent");
+        return -1;
+      }
+    }
   }
 }
 
@@ -768,17 +5345,33 @@ int main(int argc, char* argv[])
 {
   const char* pname = argv[0];
   const char* devroot = "/dev/input";
-  char* device = NULL;
+  char* device_paths[MAX_DEVICES];
+  int num_device_paths = 0;
   char* sockname = DEFAULT_SOCKET_NAME;
   char* stdin_file = NULL;
+  char* cache_file = NULL;
+  char* record_file = NULL;
   int use_stdin = 0;
+  int cached = 0;
+  int send_all_events = 0;
+  int coalesce_moves = 0;
+  int use_writer = 0;
+  int writer_priority = 0;
+  int writer_cpu = -1;
+  int use_uinput = 0;
+  int preset = 0;
   int android_service_fd = -1;
 
   int opt;
-  while ((opt = getopt(argc, argv, "d:n:vif:h")) != -1) {
+  while ((opt = getopt(argc, argv, "d:n:vif:c:sar:mwp:x:uh")) != -1) {
     switch (opt) {
       case 'd':
-        device = optarg;
+        if (num_device_paths == MAX_DEVICES)
+        {
+          fprintf(stderr, "At most %d devices are supported\n", MAX_DEVICES);
+          return EXIT_FAILURE;
+        }
+        device_paths[num_device_paths++] = optarg;
         break;
       case 'n':
         sockname = optarg;
@@ -792,6 +5385,35 @@ int main(int argc, char* argv[])
       case 'f':
         stdin_file = optarg;
         break;
+      case 'c':
+        cache_file = optarg;
+        break;
+      case 's':
+        g_stats_enabled = 1;
+        break;
+      case 'a':
+        send_all_events = 1;
+        break;
+      case 'r':
+        record_file = optarg;
+        break;
+      case 'm':
+        coalesce_moves = 1;
+        break;
+      case 'w':
+        use_writer = 1;
+        break;
+      case 'p':
+        use_writer = 1;
+        writer_priority = atoi(optarg);
+        break;
+      case 'x':
+        use_writer = 1;
+        writer_cpu = atoi(optarg);
+        break;
+      case 'u':
+        use_uinput = 1;
+        break;
       case '?':
         usage(pname);
         return EXIT_FAILURE;
@@ -801,26 +5423,49 @@ int main(int argc, char* argv[])
     }
   }
 
-  internal_state_t state = {0};
+  static internal_state_t devices[MAX_DEVICES];
+  internal_state_t* state = &devices[0];
+  int num_devices = 1;
+  int i;
 
-  if (device != NULL)
+  if (num_device_paths > 0)
   {
-    if (!consider_device(device, &state))
+    for (i = 0; i < num_device_paths; ++i)
     {
-      fprintf(stderr, "%s is not a supported touch device\n", device);
-      return EXIT_FAILURE;
+      if (!consider_device(device_paths[i], &devices[i]))
+      {
+        fprintf(stderr, "%s is not a supported touch device\n",
+          device_paths[i]);
+        return EXIT_FAILURE;
+      }
     }
+
+    num_devices = num_device_paths;
+
+    // The cache only ever describes the autodetected device.
+    cache_file = NULL;
+  }
+  else if (cache_file != NULL && load_device_cache(cache_file, state))
+  {
+    cached = 1;
   }
   else
   {
-    if (walk_devices(devroot, &state) != 0)
+    if (walk_devices(devroot, state) != 0 && !use_uinput)
     {
       fprintf(stderr, "Unable to crawl %s for touch devices\n", devroot);
       return EXIT_FAILURE;
     }
   }
 
-  if (state.evdev == NULL)
+  if (state->evdev == NULL && !cached && use_uinput)
+  {
+    fprintf(stderr, "No touch device to copy, using a preset\n");
+    preset_capabilities(state);
+    preset = 1;
+  }
+
+  if (state->evdev == NULL && !cached && !preset)
   {
     fprintf(stderr, "Unable to find a suitable touch device\n");
     android_service_fd = connect_android_service();
@@ -828,77 +5473,125 @@ int main(int argc, char* argv[])
       return EXIT_FAILURE;
     }
   } else {
-    state.has_mtslot =
-      libevdev_has_event_code(state.evdev, EV_ABS, ABS_MT_SLOT);
-    state.has_tracking_id =
-      libevdev_has_event_code(state.evdev, EV_ABS, ABS_MT_TRACKING_ID);
-    state.has_key_btn_touch =
-      libevdev_has_event_code(state.evdev, EV_KEY, BTN_TOUCH);
-    state.has_touch_major =
-      libevdev_has_event_code(state.evdev, EV_ABS, ABS_MT_TOUCH_MAJOR);
-    state.has_width_major =
-      libevdev_has_event_code(state.evdev, EV_ABS, ABS_MT_WIDTH_MAJOR);
-
-    state.has_pressure =
-      libevdev_has_event_code(state.evdev, EV_ABS, ABS_MT_PRESSURE);
-    state.min_pressure = state.has_pressure ?
-      libevdev_get_abs_minimum(state.evdev, ABS_MT_PRESSURE) : 0;
-    state.max_pressure= state.has_pressure ?
-      libevdev_get_abs_maximum(state.evdev, ABS_MT_PRESSURE) : 0;
-
-    state.max_x = libevdev_get_abs_maximum(state.evdev, ABS_MT_POSITION_X);
-    state.max_y = libevdev_get_abs_maximum(state.evdev, ABS_MT_POSITION_Y);
-
-    state.max_tracking_id = state.has_tracking_id
-      ? libevdev_get_abs_maximum(state.evdev, ABS_MT_TRACKING_ID)
-      : INT_MAX;
-
-    if (!state.has_mtslot && state.max_tracking_id == 0)
-    {
-      // The touch device reports incorrect values. There would be no point
-      // in supporting ABS_MT_TRACKING_ID at all if the maximum value was 0
-      // (i.e. one contact). This happens on Lenovo Yoga Tablet B6000-F,
-      // which actually seems to support ~10 contacts. So, we'll just go with
-      // as many as we can and hope that the system will ignore extra contacts.
-      state.max_tracking_id = MAX_SUPPORTED_CONTACTS - 1;
-      fprintf(stderr,
-        "Note: type A device reports a max value of 0 for ABS_MT_TRACKING_ID. "
-        "This means that the device is most likely reporting incorrect "
-        "information. Guessing %d.\n",
-        state.max_tracking_id
-      );
-    }
-
-    state.max_contacts = state.has_mtslot
-      ? libevdev_get_abs_maximum(state.evdev, ABS_MT_SLOT) + 1
-      : (state.has_tracking_id ? state.max_tracking_id + 1 : 2);
-
-    state.tracking_id = 0;
-
-    int contact;
-    for (contact = 0; contact < MAX_SUPPORTED_CONTACTS; ++contact)
-    {
-      state.contacts[contact].enabled = 0;
-    }
+    for (i = 0; i < num_devices; ++i)
+    {
+      state = &devices[i];
 
-    fprintf(stderr,
-      "%s touch device %s (%dx%d with %d contacts) detected on %s (score %d)\n",
-      state.has_mtslot ? "Type B" : "Type A",
-      libevdev_get_name(state.evdev),
-      state.max_x, state.max_y, state.max_contacts,
-      state.path, state.score
-    );
+      if (!cached && !preset)
+      {
+        read_capabilities(state);
+
+        if (cache_file != NULL)
+        {
+          save_device_cache(cache_file, state);
+        }
+      }
+
+      state->tracking_id = 0;
+
+      if (!preset)
+      {
+        fprintf(stderr,
+          "%s touch device %s (%dx%d with %d contacts) detected on %s (score %d)\n",
+          state->has_mtslot ? "Type B" : "Type A",
+          state->name,
+          state->max_x, state->max_y, state->max_contacts,
+          state->path, state->score
+        );
+      }
+
+      // Type B devices tell us exactly how many slots they have, but the
+      // tracking ID range of Type A devices is not a reliable indication.
+      if (!state->has_mtslot && state->max_contacts > MAX_TYPE_A_CONTACTS) {
+        fprintf(stderr, "Note: hard-limiting maximum number of contacts to %d\n",
+          MAX_TYPE_A_CONTACTS);
+        state->max_contacts = MAX_TYPE_A_CONTACTS;
+      }
+
+      if (use_uinput)
+      {
+        if (create_uinput_device(state) != 0)
+        {
+          fprintf(stderr, "Unable to create a uinput device\n");
+          return EXIT_FAILURE;
+        }
+
+        fprintf(stderr, "Injecting through virtual touch device %s on %s\n",
+          state->name, state->path);
+      }
+
+      if (init_contacts(state) != 0)
+      {
+        return EXIT_FAILURE;
+      }
+
+      select_backend(state);
 
-    if (state.max_contacts > MAX_SUPPORTED_CONTACTS) {
-      fprintf(stderr, "Note: hard-limiting maximum number of contacts to %d\n",
-        MAX_SUPPORTED_CONTACTS);
-      state.max_contacts = MAX_SUPPORTED_CONTACTS;
+      state->suppress_events = !send_all_events;
+      state->coalesce_moves = coalesce_moves;
+      forget_sent_values(state);
     }
   }
 
   FILE* input;
   FILE* output;
 
+  if (record_file != NULL)
+  {
+    if (android_service_fd > 0 || use_uinput)
+    {
+      fprintf(stderr, "Recording requires a touch device\n");
+      return EXIT_FAILURE;
+    }
+
+    if (strcmp(record_file, "-") == 0)
+    {
+      output = stdout;
+    }
+    else if ((output = fopen(record_file, "w")) == NULL)
+    {
+      fprintf(stderr, "Unable to open '%s': %s\n",
+              record_file, strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Recording touches to '%s'\n", record_file);
+
+    if (num_devices > 1)
+      fprintf(stderr, "Note: only recording %s\n", devices[0].path);
+
+    if (record_device(&devices[0], output) != 0)
+      return EXIT_FAILURE;
+
+    fclose(output);
+    return EXIT_SUCCESS;
+  }
+
+  if (stdin_file != NULL && android_service_fd < 0)
+  {
+    fprintf(stderr, "Replaying commands from '%s'\n", stdin_file);
+
+    if (replay_script(stdin_file, devices, num_devices) != 0)
+      return EXIT_FAILURE;
+
+    for (i = 0; i < num_devices; ++i)
+    {
+      libevdev_free(devices[i].evdev);
+      close(devices[i].fd);
+    }
+    return EXIT_SUCCESS;
+  }
+
+  // A client going away mid-write is handled wherever we write to it, and
+  // must not take everyone else down with it.
+  signal(SIGPIPE, SIG_IGN);
+
+  if (use_writer && android_service_fd < 0)
+  {
+    if (start_writer(writer_cpu, writer_priority) != 0)
+      return EXIT_FAILURE;
+  }
+
   if (use_stdin || stdin_file != NULL)
   {
     if (stdin_file != NULL)
@@ -926,18 +5619,18 @@ int main(int argc, char* argv[])
 
     output = stderr;
     if(android_service_fd > 0) {
-      proxy_handler(input, output, android_service_fd);
+      proxy_handler(fileno(input), fileno(output), android_service_fd);
     } else {
-      io_handler(input, output, &state);
+      io_handler(fileno(input), fileno(output), devices, num_devices);
+
+      if (g_writer != NULL)
+        stop_writer(g_writer);
     }
     fclose(input);
     fclose(output);
     exit(EXIT_SUCCESS);
   }
 
-  struct sockaddr_un client_addr;
-  socklen_t client_addr_length = sizeof(client_addr);
-
   int server_fd = start_server(sockname);
 
   if (server_fd < 0)
@@ -946,49 +5639,57 @@ int main(int argc, char* argv[])
     return EXIT_FAILURE;
   }
 
-  while (1)
+  if (android_service_fd > 0)
   {
-    int client_fd = accept(server_fd, (struct sockaddr *) &client_addr,
-      &client_addr_length);
+    // The agent only has a single connection, so there's no point in
+    // accepting more than one client at a time.
+    struct sockaddr_un client_addr;
+    socklen_t client_addr_length = sizeof(client_addr);
 
-    if (client_fd < 0)
+    while (1)
     {
-      perror("accepting client");
-      exit(1);
-    }
+      int client_fd = accept(server_fd, (struct sockaddr *) &client_addr,
+        &client_addr_length);
 
-    fprintf(stderr, "Connection established\n");
+      if (client_fd < 0)
+      {
+        perror("accepting client");
+        exit(1);
+      }
 
-    input = fdopen(client_fd, "r");
-    if (input == NULL)
-    {
-      fprintf(stderr, "%s: fdopen(client_fd,'r')\n", strerror(errno));
-      exit(1);
-    }
+      fprintf(stderr, "Connection established\n");
 
-    output = fdopen(dup(client_fd), "w");
-    if (output == NULL)
-    {
-      fprintf(stderr, "%s: fdopen(client_fd,'w')\n", strerror(errno));
-      exit(1);
-    }
+      if (proxy_handler(client_fd, client_fd, android_service_fd) != 0)
+      {
+        close(client_fd);
+        return EXIT_FAILURE;
+      }
 
-    if(android_service_fd > 0) {
-      proxy_handler(input, output, android_service_fd);
-    } else {
-      io_handler(input, output, &state);
+      fprintf(stderr, "Connection closed\n");
+      close(client_fd);
     }
+  }
 
-    fprintf(stderr, "Connection closed\n");
-    fclose(input);
-    fclose(output);
-    close(client_fd);
+  server_t server;
+
+  if (init_server(&server, server_fd, devices, num_devices) != 0)
+  {
+    fprintf(stderr, "Unable to start server on %s\n", sockname);
+    return EXIT_FAILURE;
   }
 
+  event_loop(&server);
+
+  if (g_writer != NULL)
+    stop_writer(g_writer);
+
   close(server_fd);
 
-  libevdev_free(state.evdev);
-  close(state.fd);
+  for (i = 0; i < num_devices; ++i)
+  {
+    libevdev_free(devices[i].evdev);
+    close(devices[i].fd);
+  }
 
   return EXIT_SUCCESS;
 }